@@ -0,0 +1,246 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisBench.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Benchmark driver for the ThorlabsKinesisTCubeServo adapter.
+//                Runs scripted workloads straight against the device object,
+//                without MMCore, and reports throughput and latency.
+//
+//                Link with ThorlabsKinesisTCubeServo.cpp, MMDevice and either
+//                  MockKinesis.cpp                           (mock backend), or
+//                  Thorlabs.MotionControl.TCube.DCServo.lib  (pass-through to
+//                                                             real hardware)
+//                so that the same workloads can be compared on both.
+//
+// USAGE:         KinesisBench [-serial SN] [-planes N] [-step um] [-async]
+//                             [-jitter s] [-storm s]
+//
+
+#include "ThorlabsKinesisTCubeServo.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+
+namespace {
+
+struct BenchOptions
+{
+	BenchOptions() : planes(100), stepUm(0.5), asyncMoves(false), jitterS(5.0), stormS(5.0) {}
+
+	std::string serialNo;
+	long planes;
+	double stepUm;
+	bool asyncMoves;
+	double jitterS;
+	double stormS;
+};
+
+long long NowUs()
+{
+	return KinesisStatusCache::NowUs();
+}
+
+void Report(const char* name, const KinesisHistogram& histogram, double elapsedS)
+{
+	unsigned long long count = histogram.Count();
+	std::printf("  %-28s n=%-7llu rate=%9.1f/s  p50=%9.0f  p99=%9.0f  max=%9llu us\n",
+		name, count, elapsedS > 0 ? count / elapsedS : 0.0,
+		histogram.Percentile(0.5), histogram.Percentile(0.99), histogram.Max());
+}
+
+/** Polls Busy() the way MMCore's waitForDevice does, returns the poll count. */
+long WaitWhileBusy(ThorlabsKinesisTCubeServo& stage)
+{
+	long polls = 0;
+	while (stage.Busy())
+	{
+		polls++;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return polls;
+}
+
+/** Steps through N planes, waiting for each move like an acquisition would. */
+void RunZStack(ThorlabsKinesisTCubeServo& stage, const BenchOptions& options)
+{
+	KinesisHistogram planeUs, commandUs, polls;
+	double startUm = 0.0;
+	stage.GetPositionUm(startUm);
+
+	long long begin = NowUs();
+	for (long i = 0; i < options.planes; i++)
+	{
+		long long planeStart = NowUs();
+		stage.SetPositionUm(startUm + (i + 1) * options.stepUm);
+		commandUs.Record(NowUs() - planeStart);
+		polls.Record(WaitWhileBusy(stage));
+		planeUs.Record(NowUs() - planeStart);
+	}
+	double elapsedS = (NowUs() - begin) / 1e6;
+
+	stage.SetPositionUm(startUm);
+	WaitWhileBusy(stage);
+
+	std::printf("z-stack: %ld planes of %.3f um in %.3f s\n", options.planes, options.stepUm, elapsedS);
+	Report("plane (command to idle)", planeUs, elapsedS);
+	Report("SetPositionUm", commandUs, elapsedS);
+	Report("Busy() polls per plane", polls, elapsedS);
+}
+
+/** Live-focus style: small random corrections fired at 50 Hz, without waiting. */
+void RunFocusJitter(ThorlabsKinesisTCubeServo& stage, const BenchOptions& options)
+{
+	KinesisHistogram commandUs, readUs;
+	std::mt19937 rng(12345);
+	std::uniform_real_distribution<double> jitter(-0.2, 0.2);
+	double centreUm = 0.0;
+	stage.GetPositionUm(centreUm);
+
+	long long begin = NowUs();
+	long long end = begin + (long long)(options.jitterS * 1e6);
+	while (NowUs() < end)
+	{
+		long long t0 = NowUs();
+		stage.SetPositionUm(centreUm + jitter(rng));
+		long long t1 = NowUs();
+		double posUm;
+		stage.GetPositionUm(posUm);
+		long long t2 = NowUs();
+		commandUs.Record(t1 - t0);
+		readUs.Record(t2 - t1);
+		std::this_thread::sleep_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(20) - std::chrono::microseconds(t2 - t0));
+	}
+	double elapsedS = (NowUs() - begin) / 1e6;
+	WaitWhileBusy(stage);
+
+	std::printf("focus jitter: %.1f s\n", elapsedS);
+	Report("SetPositionUm", commandUs, elapsedS);
+	Report("GetPositionUm", readUs, elapsedS);
+}
+
+/** Reads every property in a tight loop from a second thread during a z-stack. */
+void RunPropertyStorm(ThorlabsKinesisTCubeServo& stage, const BenchOptions& options)
+{
+	std::vector<std::string> names;
+	char name[MM::MaxStrLength];
+	for (unsigned i = 0; i < stage.GetNumberOfProperties(); i++)
+	{
+		if (stage.GetPropertyName(i, name))
+			names.push_back(name);
+	}
+
+	KinesisHistogram propertyUs;
+	std::atomic<bool> running(true);
+	std::thread storm([&]() {
+		char value[MM::MaxStrLength];
+		while (running)
+		{
+			for (size_t i = 0; i < names.size() && running; i++)
+			{
+				long long t0 = NowUs();
+				stage.GetProperty(names[i].c_str(), value);
+				propertyUs.Record(NowUs() - t0);
+			}
+		}
+	});
+
+	long long begin = NowUs();
+	long long end = begin + (long long)(options.stormS * 1e6);
+	KinesisHistogram planeUs;
+	double startUm = 0.0;
+	stage.GetPositionUm(startUm);
+	for (long i = 0; NowUs() < end; i++)
+	{
+		long long planeStart = NowUs();
+		stage.SetPositionUm(startUm + ((i % 10) + 1) * options.stepUm);
+		WaitWhileBusy(stage);
+		planeUs.Record(NowUs() - planeStart);
+	}
+	running = false;
+	storm.join();
+	double elapsedS = (NowUs() - begin) / 1e6;
+	stage.SetPositionUm(startUm);
+	WaitWhileBusy(stage);
+
+	std::printf("property storm: %u properties, %.1f s\n", (unsigned)names.size(), elapsedS);
+	Report("GetProperty", propertyUs, elapsedS);
+	Report("plane (command to idle)", planeUs, elapsedS);
+}
+
+bool ParseOptions(int argc, char** argv, BenchOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "-serial" && hasValue)
+			options.serialNo = argv[++i];
+		else if (arg == "-planes" && hasValue)
+			options.planes = std::atol(argv[++i]);
+		else if (arg == "-step" && hasValue)
+			options.stepUm = std::atof(argv[++i]);
+		else if (arg == "-async")
+			options.asyncMoves = true;
+		else if (arg == "-jitter" && hasValue)
+			options.jitterS = std::atof(argv[++i]);
+		else if (arg == "-storm" && hasValue)
+			options.stormS = std::atof(argv[++i]);
+		else
+			return false;
+	}
+	return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: KinesisBench [-serial SN] [-planes N] [-step um] [-async] [-jitter s] [-storm s]\n");
+		return 2;
+	}
+
+	ThorlabsKinesisTCubeServo stage;
+	if (options.serialNo.empty())
+	{
+		std::vector<std::string> serialNos = KinesisDeviceRegistry::Instance().SerialNumbers();
+		if (serialNos.empty())
+		{
+			std::fprintf(stderr, "no TDC001 found\n");
+			return 1;
+		}
+		options.serialNo = serialNos[0];
+	}
+	stage.SetProperty("Serial Number", options.serialNo.c_str());
+
+	long long initStart = NowUs();
+	int ret = stage.Initialize();
+	if (ret != DEVICE_OK)
+	{
+		std::fprintf(stderr, "Initialize failed: %d\n", ret);
+		return 1;
+	}
+	std::printf("device %s initialized in %.1f ms\n", options.serialNo.c_str(), (NowUs() - initStart) / 1e3);
+	if (options.asyncMoves)
+		stage.SetProperty("Asynchronous Moves", "Yes");
+
+	if (options.planes > 0)
+		RunZStack(stage, options);
+	if (options.jitterS > 0)
+		RunFocusJitter(stage, options);
+	if (options.stormS > 0)
+		RunPropertyStorm(stage, options);
+
+	stage.Shutdown();
+	return 0;
+}
@@ -0,0 +1,846 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MockKinesis.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Software stand-in for Thorlabs.MotionControl.TCube.DCServo.dll,
+//                implementing the CC_* / TLI_* calls the adapter makes, so that
+//                the adapter can be benchmarked without hardware.
+//
+//                Behaviour is set through environment variables:
+//                  KINESIS_MOCK_SERIALS     comma separated serial numbers (83000001)
+//                  KINESIS_MOCK_CALL_US     latency of every DLL call (300)
+//                  KINESIS_MOCK_MSG_US      move end to "moved" message delay (2000)
+//                  KINESIS_MOCK_REPLY_US    CC_Request* to reply delay (3000)
+//                  KINESIS_MOCK_VEL_MM_S    maximum velocity (2.3)
+//                  KINESIS_MOCK_ACCEL_MM_S2 acceleration (1.5)
+//
+//                As in the real DLL, CC_GetPosition / CC_GetStatusBits return a
+//                local copy, refreshed on every poll tick at the interval given
+//                to CC_StartPolling, when a CC_Request* reply arrives, and with
+//                a move's end message.
+//
+//                Positions are in counts of a Z8 actuator (34304 per mm).
+//                Velocity and acceleration device units are taken to be
+//                counts/s and counts/s^2.
+//
+
+#define TCUBEDCSERVODLL_EXPORTS
+#include <windows.h>
+#include "Thorlabs.MotionControl.TCube.DCServo.h"
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+// Message codes, the same values as in ThorlabsKinesisTCubeServo.h
+#define KINESIS_MSG_GENERIC_MOTOR    2
+#define KINESIS_MSG_HOMED            0
+#define KINESIS_MSG_MOVED            1
+#define KINESIS_MSG_STOPPED          2
+
+namespace {
+
+const double g_CountsPerMm = 34304.0;
+
+long EnvLong(const char* name, long defaultValue)
+{
+	const char* value = std::getenv(name);
+	return value ? std::atol(value) : defaultValue;
+}
+
+double EnvDouble(const char* name, double defaultValue)
+{
+	const char* value = std::getenv(name);
+	return value ? std::atof(value) : defaultValue;
+}
+
+void CallLatency()
+{
+	static const long callUs = EnvLong("KINESIS_MOCK_CALL_US", 300);
+	if (callUs > 0)
+		std::this_thread::sleep_for(std::chrono::microseconds(callUs));
+}
+
+struct MockMessage
+{
+	WORD type;
+	WORD id;
+	DWORD data;
+};
+
+class MockDevice
+{
+public:
+	MockDevice() :
+		open_(false),
+		homed_(false),
+		homing_(false),
+		startPos_(0),
+		targetPos_(0),
+		durationS_(0.0),
+		moving_(false),
+		messageDue_(false),
+		pendingCallbacks_(0),
+		callback_(0),
+		polling_(false),
+		pollIntervalMs_(0),
+		replyPending_(false),
+		copyPosition_(0),
+		copyStatusBits_(0),
+		relDistance_(0),
+		absPosition_(0),
+		backlash_(0)
+	{
+		velParams_.minVelocity = 0;
+		velParams_.maxVelocity = (int)(EnvDouble("KINESIS_MOCK_VEL_MM_S", 2.3) * g_CountsPerMm);
+		velParams_.acceleration = (int)(EnvDouble("KINESIS_MOCK_ACCEL_MM_S2", 1.5) * g_CountsPerMm);
+		messageDelayUs_ = EnvLong("KINESIS_MOCK_MSG_US", 2000);
+		replyDelayUs_ = EnvLong("KINESIS_MOCK_REPLY_US", 3000);
+		pid_.proportionalGain = 435;
+		pid_.integralGain = 195;
+		pid_.differentialGain = 993;
+		pid_.integralLimit = 195;
+		pid_.parameterFilter = 0x0f;
+		jog_.mode = MOT_SingleStep;
+		jog_.stepSize = 1715;
+		jog_.velParams = velParams_;
+		jog_.stopMode = MOT_Profiled;
+	}
+
+	~MockDevice() { StopPolling(); }
+
+	void Open()
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		open_ = true;
+		UpdateCopyLocked();
+	}
+	void Close() { StopPolling(); std::lock_guard<std::mutex> guard(lock_); open_ = false; }
+	bool IsOpen() { std::lock_guard<std::mutex> guard(lock_); return open_; }
+
+	void StartPolling(int intervalMs)
+	{
+		StopPolling();
+		pollIntervalMs_ = intervalMs;
+		lastPollUpdate_ = std::chrono::steady_clock::now();
+		polling_ = true;
+		poller_ = std::thread(&MockDevice::Poll, this);
+	}
+
+	void StopPolling()
+	{
+		polling_ = false;
+		if (poller_.joinable())
+			poller_.join();
+	}
+
+	void MoveTo(int target)
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		startPos_ = PositionLocked();
+		targetPos_ = target;
+		moveStart_ = std::chrono::steady_clock::now();
+		durationS_ = TravelTime(std::fabs((double)(targetPos_ - startPos_)));
+		moving_ = true;
+		messageDue_ = true;
+	}
+
+	void Home()
+	{
+		MoveTo(0);
+		std::lock_guard<std::mutex> guard(lock_);
+		homing_ = true;
+	}
+
+	void Stop()
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		int position = PositionLocked();
+		startPos_ = targetPos_ = position;
+		moving_ = false;
+		messageDue_ = false;
+		UpdateCopyLocked();
+		PushLocked(KINESIS_MSG_GENERIC_MOTOR, KINESIS_MSG_STOPPED, 0);
+	}
+
+	/** Live position, as the controller knows it. */
+	int Position() { std::lock_guard<std::mutex> guard(lock_); return PositionLocked(); }
+
+	/** The DLL's local copy, as CC_GetPosition / CC_GetStatusBits see it. */
+	int CopyPosition() { std::lock_guard<std::mutex> guard(lock_); return copyPosition_; }
+	DWORD CopyStatusBits() { std::lock_guard<std::mutex> guard(lock_); return copyStatusBits_; }
+
+	/** A CC_Request* call: the copy is refreshed once the reply is due. */
+	void Request()
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		if (replyPending_)
+			return;
+		replyPending_ = true;
+		replyDue_ = std::chrono::steady_clock::now() + std::chrono::microseconds(replyDelayUs_);
+	}
+
+	void SetCallback(void (*callback)()) { std::lock_guard<std::mutex> guard(lock_); callback_ = callback; }
+
+	bool NextMessage(WORD* type, WORD* id, DWORD* data)
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		if (messages_.empty())
+			return false;
+		*type = messages_.front().type;
+		*id = messages_.front().id;
+		*data = messages_.front().data;
+		messages_.pop_front();
+		return true;
+	}
+
+	int QueueSize() { std::lock_guard<std::mutex> guard(lock_); return (int)messages_.size(); }
+	void ClearQueue() { std::lock_guard<std::mutex> guard(lock_); messages_.clear(); }
+
+	MOT_VelocityParameters VelParams() { std::lock_guard<std::mutex> guard(lock_); return velParams_; }
+	void SetVelParams(int acceleration, int maxVelocity)
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		velParams_.acceleration = acceleration;
+		velParams_.maxVelocity = maxVelocity;
+	}
+
+	MOT_DC_PIDParameters PidParams() { std::lock_guard<std::mutex> guard(lock_); return pid_; }
+	void SetPidParams(const MOT_DC_PIDParameters& pid) { std::lock_guard<std::mutex> guard(lock_); pid_ = pid; }
+
+	MOT_JogParameters JogParams() { std::lock_guard<std::mutex> guard(lock_); return jog_; }
+	void SetJogParams(const MOT_JogParameters& jog) { std::lock_guard<std::mutex> guard(lock_); jog_ = jog; }
+
+	void SetRelDistance(int distance) { std::lock_guard<std::mutex> guard(lock_); relDistance_ = distance; }
+	int RelDistance() { std::lock_guard<std::mutex> guard(lock_); return relDistance_; }
+	void SetAbsPosition(int position) { std::lock_guard<std::mutex> guard(lock_); absPosition_ = position; }
+	int AbsPosition() { std::lock_guard<std::mutex> guard(lock_); return absPosition_; }
+	void SetBacklash(long distance) { std::lock_guard<std::mutex> guard(lock_); backlash_ = distance; }
+	long Backlash() { std::lock_guard<std::mutex> guard(lock_); return backlash_; }
+
+private:
+	/** Trapezoidal (or triangular, for short moves) profile duration in s. */
+	double TravelTime(double distance) const
+	{
+		double accel = velParams_.acceleration > 0 ? velParams_.acceleration : 1.0;
+		double vel = velParams_.maxVelocity > 0 ? velParams_.maxVelocity : 1.0;
+		double rampDistance = vel * vel / accel;
+		if (distance <= rampDistance)
+			return 2.0 * std::sqrt(distance / accel);
+		return 2.0 * vel / accel + (distance - rampDistance) / vel;
+	}
+
+	double ElapsedLocked() const
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - moveStart_).count();
+	}
+
+	bool InMotionLocked() const { return moving_ && ElapsedLocked() < durationS_; }
+
+	DWORD StatusBitsLocked() const
+	{
+		DWORD bits = homed_ ? 0x400 : 0;
+		if (InMotionLocked())
+			bits |= homing_ ? 0x200 : (targetPos_ >= startPos_ ? 0x10 : 0x20);
+		return bits;
+	}
+
+	void UpdateCopyLocked()
+	{
+		copyPosition_ = PositionLocked();
+		copyStatusBits_ = StatusBitsLocked();
+	}
+
+	int PositionLocked() const
+	{
+		if (!moving_ || durationS_ <= 0.0)
+			return targetPos_;
+		double t = ElapsedLocked();
+		if (t >= durationS_)
+			return targetPos_;
+
+		// distance along the profile, assuming symmetric ramps
+		double accel = velParams_.acceleration > 0 ? velParams_.acceleration : 1.0;
+		double distance = std::fabs((double)(targetPos_ - startPos_));
+		double rampTime = std::fmin((double)velParams_.maxVelocity / accel, durationS_ / 2);
+		double vel = accel * rampTime;
+		double travelled;
+		if (t < rampTime)
+			travelled = accel * t * t / 2;
+		else if (t < durationS_ - rampTime)
+			travelled = accel * rampTime * rampTime / 2 + vel * (t - rampTime);
+		else
+			travelled = distance - accel * (durationS_ - t) * (durationS_ - t) / 2;
+		int direction = targetPos_ >= startPos_ ? 1 : -1;
+		return startPos_ + direction * (int)std::lround(travelled);
+	}
+
+	void PushLocked(WORD type, WORD id, DWORD data)
+	{
+		MockMessage message = { type, id, data };
+		messages_.push_back(message);
+		pendingCallbacks_++;
+	}
+
+	void Poll()
+	{
+		while (polling_)
+		{
+			void (*callback)() = 0;
+			int callbacks = 0;
+			{
+				std::lock_guard<std::mutex> guard(lock_);
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				if (now - lastPollUpdate_ >= std::chrono::milliseconds(pollIntervalMs_))
+				{
+					lastPollUpdate_ = now;
+					UpdateCopyLocked();
+				}
+				if (replyPending_ && now >= replyDue_)
+				{
+					replyPending_ = false;
+					UpdateCopyLocked();
+				}
+				if (messageDue_ && ElapsedLocked() * 1e6 >= durationS_ * 1e6 + messageDelayUs_)
+				{
+					messageDue_ = false;
+					moving_ = false;
+					startPos_ = targetPos_;
+					// the end message comes with a status update
+					copyPosition_ = targetPos_;
+					copyStatusBits_ = homing_ ? 0x400 : StatusBitsLocked();
+					if (homing_)
+					{
+						homing_ = false;
+						homed_ = true;
+						PushLocked(KINESIS_MSG_GENERIC_MOTOR, KINESIS_MSG_HOMED, 0);
+					}
+					else
+					{
+						PushLocked(KINESIS_MSG_GENERIC_MOTOR, KINESIS_MSG_MOVED, 0);
+					}
+				}
+				callback = callback_;
+				callbacks = pendingCallbacks_;
+				pendingCallbacks_ = 0;
+			}
+			// the real DLL invokes the callback once per queued message, from its own thread
+			for (int i = 0; callback && i < callbacks; i++)
+				callback();
+			// tick well below the poll interval so that the message and reply delays are honoured
+			std::this_thread::sleep_for(std::chrono::microseconds(250));
+		}
+	}
+
+	std::mutex lock_;
+	bool open_;
+	bool homed_;
+	bool homing_;
+	int startPos_;
+	int targetPos_;
+	std::chrono::steady_clock::time_point moveStart_;
+	double durationS_;
+	bool moving_;
+	bool messageDue_;
+	long messageDelayUs_;
+	MOT_VelocityParameters velParams_;
+	std::deque<MockMessage> messages_;
+	int pendingCallbacks_;
+	void (*callback_)();
+	std::atomic<bool> polling_;
+	std::thread poller_;
+	int pollIntervalMs_;
+	std::chrono::steady_clock::time_point lastPollUpdate_;
+	long replyDelayUs_;
+	bool replyPending_;
+	std::chrono::steady_clock::time_point replyDue_;
+	int copyPosition_;
+	DWORD copyStatusBits_;
+	int relDistance_;
+	int absPosition_;
+	long backlash_;
+	MOT_DC_PIDParameters pid_;
+	MOT_JogParameters jog_;
+};
+
+std::mutex g_DevicesLock;
+std::map<std::string, MockDevice*> g_Devices;
+
+std::vector<std::string> MockSerials()
+{
+	const char* env = std::getenv("KINESIS_MOCK_SERIALS");
+	std::string list = env ? env : "83000001";
+	std::vector<std::string> serials;
+	size_t start = 0;
+	while (start <= list.size())
+	{
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.size();
+		if (end > start)
+			serials.push_back(list.substr(start, end - start));
+		start = end + 1;
+	}
+	return serials;
+}
+
+MockDevice* Find(char const* serialNo)
+{
+	std::lock_guard<std::mutex> guard(g_DevicesLock);
+	if (g_Devices.empty())
+	{
+		std::vector<std::string> serials = MockSerials();
+		for (size_t i = 0; i < serials.size(); i++)
+			g_Devices[serials[i]] = new MockDevice();
+	}
+	std::map<std::string, MockDevice*>::iterator it = g_Devices.find(serialNo ? serialNo : "");
+	return it == g_Devices.end() ? 0 : it->second;
+}
+
+} // namespace
+
+extern "C" {
+
+short __cdecl TLI_BuildDeviceList(void)
+{
+	CallLatency();
+	Find("");
+	return 0;
+}
+
+short __cdecl TLI_GetDeviceListByTypeExt(char* receiveBuffer, DWORD sizeOfBuffer, int typeID)
+{
+	CallLatency();
+	std::string list;
+	if (typeID == 83)
+	{
+		std::vector<std::string> serials = MockSerials();
+		for (size_t i = 0; i < serials.size(); i++)
+			list += serials[i] + ",";
+	}
+	if (sizeOfBuffer == 0)
+		return 1;
+	std::strncpy(receiveBuffer, list.c_str(), sizeOfBuffer - 1);
+	receiveBuffer[sizeOfBuffer - 1] = 0;
+	return 0;
+}
+
+short __cdecl TLI_GetDeviceInfo(char const* serialNo, TLI_DeviceInfo* info)
+{
+	CallLatency();
+	if (!Find(serialNo))
+		return 0;
+	std::memset(info, 0, sizeof(*info));
+	info->typeID = 83;
+	std::strncpy(info->description, "Mock TDC001", sizeof(info->description) - 1);
+	std::strncpy(info->serialNo, serialNo, sizeof(info->serialNo) - 1);
+	info->isKnownType = true;
+	info->maxChannels = 1;
+	return 1;
+}
+
+short __cdecl CC_Open(char const* serialNo)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->Open();
+	return 0;
+}
+
+void __cdecl CC_Close(char const* serialNo)
+{
+	CallLatency();
+	if (MockDevice* device = Find(serialNo))
+		device->Close();
+}
+
+bool __cdecl CC_LoadSettings(char const* serialNo) { CallLatency(); return Find(serialNo) != 0; }
+bool __cdecl CC_StartPolling(char const* serialNo, int milliseconds)
+{
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return false;
+	device->StartPolling(milliseconds);
+	return true;
+}
+
+void __cdecl CC_StopPolling(char const* serialNo)
+{
+	if (MockDevice* device = Find(serialNo))
+		device->StopPolling();
+}
+
+bool __cdecl CC_CanHome(char const* serialNo) { return Find(serialNo) != 0; }
+bool __cdecl CC_NeedsHoming(char const* serialNo) { return false; }
+bool __cdecl CC_CanMoveWithoutHomingFirst(char const* serialNo) { return true; }
+
+short __cdecl CC_Home(char const* serialNo)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->Home();
+	return 0;
+}
+
+short __cdecl CC_MoveToPosition(char const* serialNo, int index)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->MoveTo(index);
+	return 0;
+}
+
+// a velocity move runs towards the end of travel until stopped
+short __cdecl CC_MoveAtVelocity(char const* serialNo, MOT_TravelDirection direction)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->MoveTo(direction == MOT_Forwards ? (int)(12.0 * g_CountsPerMm) : 0);
+	return 0;
+}
+
+short __cdecl CC_GetJogParamsBlock(const char* serialNo, MOT_JogParameters* jogParams)
+{
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	*jogParams = device->JogParams();
+	return 0;
+}
+
+short __cdecl CC_SetJogParamsBlock(const char* serialNo, MOT_JogParameters* jogParams)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->SetJogParams(*jogParams);
+	return 0;
+}
+
+short __cdecl CC_SetJogStepSize(char const* serialNo, unsigned int stepSize)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	MOT_JogParameters jogParams = device->JogParams();
+	jogParams.stepSize = stepSize;
+	device->SetJogParams(jogParams);
+	return 0;
+}
+
+// jogs use the move profile here, the jog velocity is only stored
+short __cdecl CC_MoveJog(char const* serialNo, MOT_TravelDirection jogDirection)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	int step = (int)device->JogParams().stepSize;
+	device->MoveTo(device->Position() + (jogDirection == MOT_Forwards ? step : -step));
+	return 0;
+}
+
+short __cdecl CC_SetMoveRelativeDistance(const char* serialNo, int distance)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->SetRelDistance(distance);
+	return 0;
+}
+
+short __cdecl CC_MoveRelativeDistance(const char* serialNo)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->MoveTo(device->Position() + device->RelDistance());
+	return 0;
+}
+
+short __cdecl CC_SetMoveAbsolutePosition(const char* serialNo, int position)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->SetAbsPosition(position);
+	return 0;
+}
+
+short __cdecl CC_MoveAbsolute(const char* serialNo)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->MoveTo(device->AbsPosition());
+	return 0;
+}
+
+short __cdecl CC_StopProfiled(char const* serialNo)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->Stop();
+	return 0;
+}
+
+// the real DLL answers these from its local copy, without a USB round-trip
+int __cdecl CC_GetPosition(char const* serialNo)
+{
+	MockDevice* device = Find(serialNo);
+	return device ? device->CopyPosition() : 0;
+}
+
+DWORD __cdecl CC_GetStatusBits(char const* serialNo)
+{
+	MockDevice* device = Find(serialNo);
+	return device ? device->CopyStatusBits() : 0;
+}
+
+// either request refreshes the whole copy once the reply is due
+short __cdecl CC_RequestPosition(char const* serialNo)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->Request();
+	return 0;
+}
+
+short __cdecl CC_RequestStatusBits(char const* serialNo) { return CC_RequestPosition(serialNo); }
+
+short __cdecl CC_GetVelParams(char const* serialNo, int* acceleration, int* maxVelocity)
+{
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	MOT_VelocityParameters velParams = device->VelParams();
+	*acceleration = velParams.acceleration;
+	*maxVelocity = velParams.maxVelocity;
+	return 0;
+}
+
+short __cdecl CC_SetVelParams(char const* serialNo, int acceleration, int maxVelocity)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->SetVelParams(acceleration, maxVelocity);
+	return 0;
+}
+
+short __cdecl CC_GetVelParamsBlock(const char* serialNo, MOT_VelocityParameters* velocityParams)
+{
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	*velocityParams = device->VelParams();
+	return 0;
+}
+
+short __cdecl CC_SetVelParamsBlock(const char* serialNo, MOT_VelocityParameters* velocityParams)
+{
+	return CC_SetVelParams(serialNo, velocityParams->acceleration, velocityParams->maxVelocity);
+}
+
+short __cdecl CC_GetHardwareInfoBlock(char const* serialNo, TLI_HardwareInformation* hardwareInfo)
+{
+	CallLatency();
+	if (!Find(serialNo))
+		return 2;
+	std::memset(hardwareInfo, 0, sizeof(*hardwareInfo));
+	hardwareInfo->serialNumber = (DWORD)std::atol(serialNo);
+	std::strncpy(hardwareInfo->modelNumber, "TDC001", sizeof(hardwareInfo->modelNumber) - 1);
+	hardwareInfo->type = 83;
+	hardwareInfo->numChannels = 1;
+	hardwareInfo->firmwareVersion = 0x00020001;
+	return 0;
+}
+
+// homing parameters are accepted and reported back unchanged
+short __cdecl CC_RequestBacklash(char const* serialNo) { return Find(serialNo) ? 0 : 2; }
+
+long __cdecl CC_GetBacklash(char const* serialNo)
+{
+	MockDevice* device = Find(serialNo);
+	return device ? device->Backlash() : 0;
+}
+
+short __cdecl CC_SetBacklash(char const* serialNo, long distance)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->SetBacklash(distance);
+	return 0;
+}
+
+short __cdecl CC_GetHomingParamsBlock(const char* serialNo, MOT_HomingParameters* homingParams)
+{
+	std::memset(homingParams, 0, sizeof(*homingParams));
+	homingParams->direction = MOT_Backwards;
+	homingParams->velocity = 34304;
+	return Find(serialNo) ? 0 : 2;
+}
+
+short __cdecl CC_SetHomingParamsBlock(const char* serialNo, MOT_HomingParameters* homingParams)
+{
+	(void)homingParams;
+	CallLatency();
+	return Find(serialNo) ? 0 : 2;
+}
+
+// the mock's motor parameters are fixed
+short __cdecl CC_SetMotorParamsExt(char const* serialNo, double stepsPerRev, double gearBoxRatio, double pitch)
+{
+	(void)stepsPerRev; (void)gearBoxRatio; (void)pitch;
+	return Find(serialNo) ? 0 : 2;
+}
+
+short __cdecl CC_SetMotorTravelLimits(char const* serialNo, double minPosition, double maxPosition)
+{
+	(void)minPosition; (void)maxPosition;
+	return Find(serialNo) ? 0 : 2;
+}
+
+short __cdecl CC_SetStageAxisLimits(char const* serialNo, int minPosition, int maxPosition)
+{
+	CallLatency();
+	if (minPosition >= maxPosition)
+		return 38;
+	return Find(serialNo) ? 0 : 2;
+}
+
+void __cdecl CC_SetLimitsSoftwareApproachPolicy(char const* serialNo, MOT_LimitsSoftwareApproachPolicy limitsSoftwareApproachPolicy)
+{
+	(void)serialNo; (void)limitsSoftwareApproachPolicy;
+}
+
+// the simulated cube never drops off the bus
+bool __cdecl CC_CheckConnection(char const* serialNo) { return Find(serialNo) != 0; }
+
+void __cdecl CC_EnableLastMsgTimer(char const* serialNo, bool enable, __int32 lastMsgTimeout)
+{
+	(void)serialNo; (void)enable; (void)lastMsgTimeout;
+}
+
+bool __cdecl CC_HasLastMsgTimerOverrun(char const* serialNo) { (void)serialNo; return false; }
+
+short __cdecl CC_SetMotorVelocityLimits(char const* serialNo, double maxVelocity, double maxAcceleration)
+{
+	(void)maxVelocity; (void)maxAcceleration;
+	return Find(serialNo) ? 0 : 2;
+}
+
+short __cdecl CC_GetMotorParamsExt(char const* serialNo, double* stepsPerRev, double* gearBoxRatio, double* pitch)
+{
+	*stepsPerRev = 512;
+	*gearBoxRatio = 67;
+	*pitch = 1.0;
+	return Find(serialNo) ? 0 : 2;
+}
+
+short __cdecl CC_GetMotorTravelLimits(char const* serialNo, double* minPosition, double* maxPosition)
+{
+	*minPosition = 0.0;
+	*maxPosition = 12.0;
+	return Find(serialNo) ? 0 : 2;
+}
+
+short __cdecl CC_GetMotorVelocityLimits(char const* serialNo, double* maxVelocity, double* maxAcceleration)
+{
+	*maxVelocity = 2.6;
+	*maxAcceleration = 4.0;
+	return Find(serialNo) ? 0 : 2;
+}
+
+short __cdecl CC_GetRealValueFromDeviceUnit(char const* serialNo, int device_unit, double* real_unit, int unitType)
+{
+	// distance, velocity and acceleration all scale by counts per mm here
+	(void)unitType;
+	*real_unit = device_unit / g_CountsPerMm;
+	return Find(serialNo) ? 0 : 2;
+}
+
+short __cdecl CC_RequestDCPIDParams(char const* serialNo) { CallLatency(); return Find(serialNo) ? 0 : 2; }
+
+short __cdecl CC_GetDCPIDParams(const char* serialNo, MOT_DC_PIDParameters* params)
+{
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	*params = device->PidParams();
+	return 0;
+}
+
+short __cdecl CC_SetDCPIDParams(const char* serialNo, MOT_DC_PIDParameters* params)
+{
+	CallLatency();
+	MockDevice* device = Find(serialNo);
+	if (!device)
+		return 2;
+	device->SetPidParams(*params);
+	return 0;
+}
+
+short __cdecl CC_GetDeviceUnitFromRealValue(char const* serialNo, double real_unit, int* device_unit, int unitType)
+{
+	(void)unitType;
+	*device_unit = (int)std::lround(real_unit * g_CountsPerMm);
+	return Find(serialNo) ? 0 : 2;
+}
+
+void __cdecl CC_RegisterMessageCallback(char const* serialNo, void (*functionPointer)())
+{
+	if (MockDevice* device = Find(serialNo))
+		device->SetCallback(functionPointer);
+}
+
+bool __cdecl CC_GetNextMessage(char const* serialNo, WORD* messageType, WORD* messageID, DWORD* messageData)
+{
+	MockDevice* device = Find(serialNo);
+	return device ? device->NextMessage(messageType, messageID, messageData) : false;
+}
+
+int __cdecl CC_MessageQueueSize(char const* serialNo)
+{
+	MockDevice* device = Find(serialNo);
+	return device ? device->QueueSize() : 0;
+}
+
+void __cdecl CC_ClearMessageQueue(char const* serialNo)
+{
+	if (MockDevice* device = Find(serialNo))
+		device->ClearQueue();
+}
+
+} // extern "C"
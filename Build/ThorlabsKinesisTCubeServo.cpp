@@ -46,12 +46,13 @@
 #endif
 
 #include "ThorlabsKinesisTCubeServo.h"
-#include "Thorlabs.MotionControl.TCube.DCServo.h"
 #include <cstdio>
 #include <string>
 #include <math.h>
+#include <algorithm>
 #include <sstream>
 #include <string.h>
+#include <stdarg.h>
 
 //Short descriptions taken from the APTAPI.h
 const char* g_ThorlabsDeviceNameBSC001 = "BSC001";
@@ -76,28 +77,200 @@ const char* g_ThorlabsDeviceNameTST001 = "TST001";
 const char* g_ThorlabsDeviceDescTST001 = "1 Ch Stepper driver T-Cube";
 const char* g_ThorlabsDeviceNameTDC001 = "TDC001";
 const char* g_ThorlabsDeviceDescTDC001 = "1 Ch DC servo driver T-Cube";
+const char* g_ThorlabsDeviceNameHub = "TDC001 Hub";
+const char* g_ThorlabsDeviceDescHub = "Several TDC001 T-Cubes combined into XY and Z stages";
+const char* g_ThorlabsDeviceNameXYStage = "TDC001 XY Stage";
+const char* g_ThorlabsDeviceDescXYStage = "XY stage driven by two TDC001 T-Cubes";
+const char* g_ThorlabsDeviceNameZStage = "TDC001 Z Stage";
+const char* g_ThorlabsDeviceDescZStage = "Z stage driven by a TDC001 T-Cube of the hub";
 
 const char* g_PositionProp = "Position";
 const char* g_Keyword_Position = "Set position (um)";
 const char* g_Keyword_Velocity = "Velocity (mm/s)";
 const char* g_Keyword_Home = "Go Home";
+const char* g_HomeOnInitializeProp = "Home On Initialize";
+const char* g_HomeBlocking = "Blocking";
+const char* g_HomeBackground = "Background";
+const char* g_HomingStateProp = "Homing State";
+const char* g_HomingNotHomed = "Not Homed";
+const char* g_HomingInProgress = "Homing";
+const char* g_HomingHomed = "Homed";
+const char* g_HomingNotRequired = "Not Homed (Optional)";
+const char* g_HomingProgressProp = "Homing Progress (%)";
 
 const char* g_NumberUnitsProp = "Number of Units";
 const char* g_SerialNumberProp = "Serial Number";
+const char* g_AxisSerialProps[] = { "X Axis Serial Number", "Y Axis Serial Number", "Z Axis Serial Number" };
+const char* g_AxisNone = "None";
 const char* g_ChannelProp = "Channel";
 const char* g_MaxVelProp = "Maximum Velocity";
 const char* g_MaxAccnProp = "Maximum Acceleration";
+const char* g_AccelerationProp = "Acceleration (mm/s^2)";
+const char* g_ShortMoveThresholdProp = "Short Move Threshold (um)";
+const char* g_ShortMoveVelocityProp = "Short Move Velocity (mm/s)";
+const char* g_ShortMoveAccelerationProp = "Short Move Acceleration (mm/s^2)";
+const char* g_ScanProp = "Scan";
+const char* g_ScanIdle = "Idle";
+const char* g_ScanRunning = "Running";
+const char* g_ScanStartProp = "Scan Start (um)";
+const char* g_ScanEndProp = "Scan End (um)";
+const char* g_ScanVelocityProp = "Scan Velocity (um/s)";
+const char* g_ScanFrameRateProp = "Scan Frame Rate (Hz)";
+const char* g_ScanStepProp = "Scan Step per Frame (um)";
+const char* g_ScanSampleCountProp = "Scan Sample Count";
+const char* g_ScanExportProp = "Scan Samples Export";
+const char* g_SettingsSourceProp = "Settings Source";
+const char* g_SettingsFromCache = "Settings cache";
+const char* g_SettingsFromKinesis = "Kinesis settings";
+const char* g_JogModeProp = "Jog Mode";
+const char* g_JogStepProp = "Jog Step (um)";
+const char* g_JogVelocityProp = "Jog Velocity (mm/s)";
+const char* g_BacklashProp = "Backlash (um)";
+const char* g_ApproachModeProp = "Approach Mode";
+const char* g_ApproachDirect = "Direct";
+const char* g_ApproachFromBelow = "From Below";
+const char* g_ApproachOvershootProp = "Approach Overshoot (um)";
+const char* g_SamplerProp = "Position Sampler";
+const char* g_SamplerIntervalProp = "Position Sampler Interval (ms)";
+const char* g_SamplerFileProp = "Position Sampler File";
+const char* g_SamplerPendingProp = "Position Sampler Pending";
+const char* g_SamplerDroppedProp = "Position Sampler Dropped";
+const char* g_TimelineProp = "Motion Timeline";
+const char* g_TimelineExportProp = "Motion Timeline Export";
+const char* g_TimelineEventsProp = "Motion Timeline Events";
+const char* g_TimelineDroppedProp = "Motion Timeline Dropped";
+const char* g_TimelineCommandNames[] = { "", "MoveAbsolute", "MoveRelative", "MoveAtVelocity", "MoveJog", "Home", "Stop" };
 const char* g_MinPosProp = "Position Lower Limit (um)";
 const char* g_MaxPosProp = "Position Upper Limit (um)";
+const char* g_ConnectionProp = "Connection";
+const char* g_ConnectionOk = "Connected";
+const char* g_ConnectionLost = "Lost";
+const char* g_WatchdogTimeoutProp = "Watchdog Timeout (ms)";
+const char* g_ReconnectsProp = "Reconnects";
+const char* g_PollingIntervalProp = "Polling Interval (ms)";
+const char* g_MovingPollingIntervalProp = "Polling Interval Moving (ms)";
+const char* g_SoftLimitPolicyProp = "Soft Limit Policy";
+const char* g_SoftLimitPolicies[] = { "Reject Moves Beyond Limits", "Truncate Moves to Limits", "Allow All Moves" };
+const int g_NumSoftLimitPolicies = 3;
 const char* g_StepSizeProp = "Step Size";
+const char* g_MaxStatusAgeProp = "Max Status Age (ms)";
+const char* g_PropertyRefreshRateProp = "Property Refresh Rate (Hz)";
+const char* g_SequenceOrderProp = "Sequence Order";
+const char* g_SequenceableProp = "Stage Sequencing (Free Running)";
+const char* g_SequenceOrders[] = { "Keep Order", "Shortest", "Ascending", "Descending", "Serpentine" };
+const int g_NumSequenceOrders = 5;
+const char* g_PositionListProp = "Position List (um)";
+const char* g_SequencePlanProps[] = { "Sequence Planned Time (ms)", "Sequence Planned Travel (um)",
+	"Sequence Planned Reversals" };
+const int g_NumSequencePlanProps = 3;
+const char* g_AsyncMovesProp = "Asynchronous Moves";
+const char* g_SettleTimeProp = "Settle Time (ms)";
+const char* g_PredictedCompletionProp = "Predicted Move Completion (ms)";
+const char* g_ResetStatsProp = "Reset Stats";
+const char* g_SettleDetectionProp = "Settle Detection";
+const char* g_SettleToleranceProp = "Settle Tolerance (um)";
+const char* g_SettleSamplesProp = "Settle Samples";
+const char* g_SettleTimeoutProp = "Settle Timeout (ms)";
+const char* g_PidProfileProp = "PID Profile";
+const char* g_PidAutoTuneProp = "PID Auto-Tune";
+const char* g_PidAutoTuneStepProp = "PID Auto-Tune Step (um)";
+const char* g_LatencyMetricNames[] = { "Stats CC_MoveToPosition (us)", "Stats CC_GetPosition (us)",
+	"Stats CC_RequestStatusBits (us)", "Stats Command to Moved (us)", "Stats Busy Polls per Move",
+	"Stats Moved to Settled (us)" };
+const char* g_LatencyStatNames[] = { "p50", "p99", "max" };
+const int g_NumLatencyStats = 3;
+const char* g_Yes = "Yes";
+const char* g_No = "No";
 
-const char* g_TrigModeProp = "Trigger Mode";
 const char* g_TrigMoveProp = "Trigger Move";
 const char* g_MoveRelProp = "Trigger Step Size (um)";
-const char* g_TrigModes[] = { "Trigger In", "Trigger Out", "Trigger In/Out" };
-const char* g_TrigMoves[] = { "Relative", "Absolute", "Home" };
+const char* g_TrigAbsPosProp = "Trigger Absolute Position (um)";
+const char* g_StageProfileProp = "Stage Profile";
+const char* g_CountsPerMmProp = "Device Units per mm";
+const char* g_StageProfileAuto = "Auto (from device settings)";
+
+const char* g_TrigMoves[] = { "Relative", "Absolute" };
 const char* serials[2];
 
+// Z8 actuators: 512 counts/rev encoder, 67.49:1 gearbox, 1 mm pitch lead screw
+const KinesisStageProfile g_StageProfiles[] = {
+	{ "Z812", 34304.0 },
+	{ "Z825", 34304.0 },
+	{ "MTS50", 34304.0 },
+	{ "PRM1", 1919.6418 },
+};
+const int g_NumStageProfiles = sizeof(g_StageProfiles) / sizeof(g_StageProfiles[0]);
+
+const char* g_PidFactory = "Factory";
+const char* g_PidAutoTuned = "Auto-Tuned";
+const KinesisPidProfile g_PidProfiles[] = {
+	{ "Fast Small Steps", 1.5, 1.2, 1.5 },
+	{ "Long Travel", 1.0, 0.6, 1.0 },
+	{ "Quiet", 0.7, 0.7, 1.3 },
+};
+const int g_NumPidProfiles = sizeof(g_PidProfiles) / sizeof(g_PidProfiles[0]);
+
+// unit types of CC_GetRealValueFromDeviceUnit / CC_GetDeviceUnitFromRealValue
+const int g_UnitDistance = 0;
+const int g_UnitVelocity = 1;
+const int g_UnitAcceleration = 2;
+
+// position sampling during a continuous scan
+const int g_ScanSampleIntervalMs = 5;
+
+// how often KinesisPositionWatch checks the DLL's copy for a new position
+const long g_PositionCheckIntervalUs = 250;
+const size_t g_MaxScanSamples = 65536;
+
+// the sample file mapping grows by this many bytes at a time
+const unsigned long long g_SampleFileChunk = 16ULL << 20;
+
+// Scan properties handled by OnScanParam
+enum { ScanStart = 0, ScanEnd, ScanVelocity, ScanFrameRate, ScanStep };
+
+// Velocity profile properties handled by OnVelocityProfile
+enum { ProfileDefaultAcceleration = 0, ProfileShortVelocity, ProfileShortAcceleration };
+
+// gain factors tried by the auto-tuner, against the factory gains
+const double g_AutoTuneProportionalScales[] = { 0.75, 1.0, 1.25, 1.5, 2.0 };
+const double g_AutoTuneDifferentialScales[] = { 0.75, 1.0, 1.5 };
+const int g_MaxPidGain = 32767;
+
+// Kinesis polling interval, also used as the grace period before the move
+// tracker falls back to the cached status bits
+const int g_PollingIntervalMs = 200;
+
+// Kinesis device type of the TDC001 T-Cube DC servo controller
+const int g_TDC001TypeId = 83;
+
+// Longest RequestAndRefresh waits for the controller's reply to show up in
+// the DLL's local copy
+const long g_StatusReplyTimeoutMs = 10;
+
+// Polling rate while a move is in progress or settling, and how long it is
+// kept after the move, so that the moves of a stack do not flip it each time
+const int g_MovingPollingIntervalMs = 20;
+const long g_FastPollingLingerMs = 500;
+
+// Fraction added to a predicted move time before the status bits are checked,
+// so that an underestimate or servo ringing is not taken for a lost message
+const double g_MoveTimeMargin = 0.25;
+
+// Maximum number of positions accepted by the stage sequence and the longest
+// a single move may take before the adapter stops waiting for it
+const long g_MaxSequenceLength = 4096;
+const long g_MoveTimeoutMs = 30000;
+
+// Longest a home sequence may take; it runs at the homing velocity over
+// the full travel range
+const long g_HomeTimeoutMs = 120000;
+
+// How often buffered log messages are passed on to the core
+const long g_LogFlushIntervalMs = 100;
+
+// Shortest time between two reconnection attempts of the watchdog
+const long g_ReconnectIntervalMs = 1000;
+
 using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -108,6 +281,7 @@ MODULE_API void InitializeModuleData()
 {
 
 	RegisterDevice(g_ThorlabsDeviceNameTDC001, MM::StageDevice, g_ThorlabsDeviceDescTDC001);
+	RegisterDevice(g_ThorlabsDeviceNameHub, MM::HubDevice, g_ThorlabsDeviceDescHub);
 
 }
 
@@ -118,6 +292,11 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
 	if (deviceName == 0)
 		return 0;
 
+	if (strcmp(deviceName, g_ThorlabsDeviceNameHub) == 0)
+		return new ThorlabsKinesisHub();
+	if (strcmp(deviceName, g_ThorlabsDeviceNameXYStage) == 0)
+		return new ThorlabsKinesisXYStage();
+
 	ThorlabsKinesisTCubeServo* s = new ThorlabsKinesisTCubeServo(deviceName, chNumber);
 	return s;
 }
@@ -128,772 +307,5119 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// ThorlabsKinesisTCubeServo class
-// FIXME? as default initialises to TDC001 / 1 channel
-//
-ThorlabsKinesisTCubeServo::ThorlabsKinesisTCubeServo() :
-	hwType_(0),
-	deviceName_("ThorlabsKinesisTCubeServo"),
-	chNumber_(1),
-	stepSizeUm_(0.1),
-	initialized_(false),
-	busy_(false),
-	homed_(false),
-	answerTimeoutMs_(1000),
-	minTravelUm_(0.0),
-	maxTravelUm_(50000.0),
-	curPosUm_(0.0),
-	ccdT_(0.0),
-	mode_(0),
-	mode_m(0),
-	trigmode(0),
-	trigmove(0),
-
-	trigModeNumber_(2),
-	trigMoveNumber_(2),
-	moveRelStep_(0.5)
+// Unit conversion
+///////////////////////////////////////////////////////////////////////////////
 
+/**
+* Sets up the um <-> device unit conversion for a stage profile.
+* With the automatic profile, the scale is taken from the settings Kinesis
+* loaded for the stage, so the cube must be open.
+*/
+int ResolveKinesisUnitScale(const std::string& serialNo, const std::string& profile, KinesisUnitScale& scale)
 {
-	//use the TDC001 default
-	int hwType = 31;//HWTYPE_TDC001;
-	std::string deviceName = g_ThorlabsDeviceNameTDC001;
-	long chNumber = 1;
+	for (int i = 0; i < g_NumStageProfiles; i++)
+	{
+		if (profile == g_StageProfiles[i].name)
+		{
+			scale.SetCountsPerMm(g_StageProfiles[i].countsPerUnit);
+			return DEVICE_OK;
+		}
+	}
 
-	init(deviceName, chNumber);
+	// a large count keeps the rounding of the DLL's conversion negligible
+	const int probeCounts = 1000000;
+	double probeMm = 0.0;
+	if (CC_GetRealValueFromDeviceUnit(serialNo.c_str(), probeCounts, &probeMm, 0) == 0 && probeMm > 0.0)
+	{
+		scale.SetCountsPerMm(probeCounts / probeMm);
+		return DEVICE_OK;
+	}
+
+	double stepsPerRev = 0.0, gearBoxRatio = 0.0, pitch = 0.0;
+	CC_GetMotorParamsExt(serialNo.c_str(), &stepsPerRev, &gearBoxRatio, &pitch);
+	if (stepsPerRev <= 0.0 || gearBoxRatio <= 0.0 || pitch <= 0.0)
+		return ERR_UNRECOGNIZED_ANSWER;
+
+	scale.SetCountsPerMm(stepsPerRev * gearBoxRatio / pitch);
+	return DEVICE_OK;
 }
 
-ThorlabsKinesisTCubeServo::ThorlabsKinesisTCubeServo(std::string deviceName, long chNumber) :
-	hwType_(0),
-	deviceName_("ThorlabsKinesisTCubeServo"),
-	chNumber_(1),
-	stepSizeUm_(0.1),
-	initialized_(false),
-	busy_(false),
-	homed_(false),
-	answerTimeoutMs_(1000),
-	minTravelUm_(0.0),
-	maxTravelUm_(50000.0),
-	curPosUm_(0.0),
-	ccdT_(0.0),
-	mode_(0),
-	mode_m(0),
-	trigmode(0),
-	trigmove(0),
+///////////////////////////////////////////////////////////////////////////////
+// KinesisLogRing class
+///////////////////////////////////////////////////////////////////////////////
 
-	trigModeNumber_(2),
-	trigMoveNumber_(2),
-	moveRelStep_(0.5)
+KinesisLogRing::KinesisLogRing() :
+	head_(0),
+	tail_(0),
+	dropped_(0)
 {
-	init(deviceName, chNumber);
 }
 
-ThorlabsKinesisTCubeServo::~ThorlabsKinesisTCubeServo()
+void KinesisLogRing::Write(const char* format, ...)
 {
-	Shutdown();
+	char text[SlotSize];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	text[SlotSize - 1] = '\0';
+
+	std::lock_guard<std::mutex> guard(lock_);
+	if (head_ - tail_ == NumSlots)
+	{
+		// full: the oldest message makes room
+		tail_++;
+		dropped_++;
+	}
+	memcpy(slots_[head_ % NumSlots], text, SlotSize);
+	head_++;
 }
 
-void ThorlabsKinesisTCubeServo::GetName(char* Name) const
+bool KinesisLogRing::Pop(char* text, size_t size)
 {
-	CDeviceUtils::CopyLimitedString(Name, deviceName_.c_str());
+	std::lock_guard<std::mutex> guard(lock_);
+	if (head_ == tail_)
+		return false;
+
+	strncpy(text, slots_[tail_ % NumSlots], size - 1);
+	text[size - 1] = '\0';
+	tail_++;
+	return true;
 }
 
-int ThorlabsKinesisTCubeServo::Initialize()
+unsigned KinesisLogRing::TakeDropped()
 {
-	int ret(DEVICE_OK);
-	int hola = 0;
+	std::lock_guard<std::mutex> guard(lock_);
+	unsigned dropped = dropped_;
+	dropped_ = 0;
+	return dropped;
+}
 
-	//needed to get the hardware info
-	GetLimits(minTravelUm_, maxTravelUm_);
+///////////////////////////////////////////////////////////////////////////////
+// KinesisDeviceRegistry class
+///////////////////////////////////////////////////////////////////////////////
 
-	//change the global flag
+KinesisDeviceRegistry& KinesisDeviceRegistry::Instance()
+{
+	// deliberately leaked, see the class comment
+	static KinesisDeviceRegistry* registry = new KinesisDeviceRegistry();
+	return *registry;
+}
 
-	aptInitialized = true;
-	LogInit();
+KinesisDeviceRegistry::KinesisDeviceRegistry() :
+	clients_(0),
+	enumerated_(false)
+{
+}
 
-	tmpMessage << "InitHWDevice()";
-	LogIt();
+/**
+* Counts the devices that may prefetch or acquire cubes.
+*/
+void KinesisDeviceRegistry::AddClient()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	clients_++;
+}
 
-	/////////
+/**
+* Once the last device is gone nobody can acquire the cubes that are still
+* prefetched, so they are closed.
+*/
+void KinesisDeviceRegistry::RemoveClient()
+{
+	std::vector<std::string> serialNos;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		if (--clients_ > 0)
+			return;
+		for (std::map<std::string, Entry>::iterator it = devices_.begin(); it != devices_.end(); ++it)
+			serialNos.push_back(it->first);
+	}
+	for (size_t i = 0; i < serialNos.size(); i++)
+		CancelPrefetch(serialNos[i]);
+}
 
-	//MOT_GetVelParamLimits(serialNumber_, &pfMaxAccn, &pfMaxVel);
-	CC_GetMotorVelocityLimits(serialNumber_.c_str(), &pfMaxVel, &pfMaxAccn);
-	posUm_ = CC_GetPosition(serialNumber_.c_str());
-	tmpMessage << "pfMaxAccn:" << pfMaxAccn << " pfMaxVel:" << pfMaxVel;
-	LogIt();
+/**
+* Returns the serial numbers of the TDC001 cubes on the bus.
+* TLI_BuildDeviceList is slow and does not list devices that are already
+* open, so the bus is only enumerated on the first call.
+*/
+const std::vector<std::string>& KinesisDeviceRegistry::SerialNumbers()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	if (enumerated_)
+		return serialNos_;
+
+	enumerated_ = true;
+	if (TLI_BuildDeviceList() != 0)
+		return serialNos_;
+
+	char serialNos[512];
+	serialNos[0] = '\0';
+	TLI_GetDeviceListByTypeExt(serialNos, sizeof(serialNos), g_TDC001TypeId);
+	char *next_token1 = NULL;
+	char *p = strtok_s(serialNos, ",", &next_token1);
+	while (p != NULL)
+	{
+		TLI_DeviceInfo deviceInfo;
+		if (TLI_GetDeviceInfo(p, &deviceInfo) != 0)
+		{
+			char serialNo[9];
+			strncpy_s(serialNo, deviceInfo.serialNo, 8);
+			serialNo[8] = '\0';
+			serialNos_.push_back(serialNo);
+		}
+		p = strtok_s(NULL, ",", &next_token1);
+	}
+	return serialNos_;
+}
 
-	// READ ONLY PROPERTIES
-	CreateProperty(g_SerialNumberProp, serialNumber_.c_str(), MM::String, true);
-	CreateProperty(g_MaxVelProp, CDeviceUtils::ConvertToString(pfMaxVel), MM::String, true);
-	CreateProperty(g_MaxAccnProp, CDeviceUtils::ConvertToString(pfMaxAccn), MM::String, true);
+/**
+* Starts opening the cube in the background, if that has not been done yet.
+*/
+void KinesisDeviceRegistry::Prefetch(const std::string& serialNo)
+{
+	if (serialNo.empty())
+		return;
 
-	//Action Properties
-	CPropertyAction* pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPosition);
-	CPropertyAction* pAct2 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnVelocity);
-	CPropertyAction* pAct3 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnHome);
-	CPropertyAction* pAct4 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMinPosUm);
-	CPropertyAction* pAct5 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMaxPosUm);
+	std::lock_guard<std::mutex> guard(lock_);
+	StartOpen(serialNo);
+}
 
-	/*CPropertyAction* pAct6 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTrigMode);
-	CPropertyAction* pAct7 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTrigMove);
-	CPropertyAction* pAct8 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMoveRel);*/
+/**
+* Closes a prefetched cube again, unless it has been acquired meanwhile.
+* Called when a serial number is replaced before initialization and when a
+* device that prefetched a cube goes away.
+*/
+void KinesisDeviceRegistry::CancelPrefetch(const std::string& serialNo)
+{
+	std::shared_future<bool> opened;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		std::map<std::string, Entry>::iterator it = devices_.find(serialNo);
+		if (it == devices_.end() || it->second.refCount > 0 || it->second.waiters > 0)
+			return;
+		opened = it->second.opened;
+	}
 
+	// the cube can only be closed once the open has finished
+	bool ok = opened.valid() && opened.get();
 
-	CreateFloatProperty(g_Keyword_Position, 0, false, pAct);
-	SetPropertyLimits(g_Keyword_Position, minTravelUm_, maxTravelUm_);
+	std::lock_guard<std::mutex> guard(lock_);
+	std::map<std::string, Entry>::iterator it = devices_.find(serialNo);
+	if (it == devices_.end() || it->second.refCount > 0 || it->second.waiters > 0)
+		return;
 
-	CreateProperty(g_Keyword_Velocity, CDeviceUtils::ConvertToString(pfMaxVel), MM::Float, false, pAct2);
+	if (ok)
+	{
+		CC_StopPolling(serialNo.c_str());
+		CC_Close(serialNo.c_str());
+	}
+	devices_.erase(it);
+}
 
-	CreateProperty(g_Keyword_Home, "0", MM::Integer, false, pAct3);
-	SetPropertyLimits(g_Keyword_Home, 0, 1);
+/**
+* Waits for the cube to be open and counts the users of an open cube.
+*/
+bool KinesisDeviceRegistry::Acquire(const std::string& serialNo)
+{
+	if (serialNo.empty())
+		return false;
 
-	//By now, we now more about the hardware. Lets set proper hardware limits for g_MinPosProp / g_MaxPosProp
-	//pfMinPos*1000 / pfMaxPos*1000 are the absolute limits.
-	//FIXME may run into problems if not (plUnits == STAGE_UNITS_MM || plUnits == STAGE_UNITS_DEG)
+	std::shared_future<bool> opened;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		opened = StartOpen(serialNo);
+		devices_[serialNo].waiters++;
+	}
 
-	CreateProperty(g_MinPosProp, CDeviceUtils::ConvertToString(minTravelUm_), MM::Float, false, pAct4);
-	SetPropertyLimits(g_MinPosProp, pfMinPos * 1000, pfMaxPos * 1000);
+	bool ok = opened.get();
 
-	CreateProperty(g_MaxPosProp, CDeviceUtils::ConvertToString(maxTravelUm_), MM::Float, false, pAct5);
-	SetPropertyLimits(g_MaxPosProp, pfMinPos * 1000, pfMaxPos * 1000);
+	std::lock_guard<std::mutex> guard(lock_);
+	std::map<std::string, Entry>::iterator it = devices_.find(serialNo);
+	it->second.waiters--;
+	if (!ok)
+	{
+		// forget the failed attempt, so the next Acquire() tries again
+		if (it->second.refCount == 0 && it->second.waiters == 0)
+			devices_.erase(it);
+		return false;
+	}
 
+	it->second.refCount++;
+	return true;
+}
 
-	ret = UpdateStatus();
+void KinesisDeviceRegistry::Release(const std::string& serialNo)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	std::map<std::string, Entry>::iterator it = devices_.find(serialNo);
+	if (it == devices_.end() || it->second.refCount == 0)
+		return;
 
-	tmpMessage << "all done";
-	LogIt();
+	if (--it->second.refCount > 0)
+		return;
 
-	if (ret != DEVICE_OK)
-		return ret;
+	CC_StopPolling(serialNo.c_str());
+	CC_Close(serialNo.c_str());
+	devices_.erase(it);
+}
 
-	initialized_ = true;
-	return DEVICE_OK;
+/**
+* Must be called with lock_ held.
+*/
+std::shared_future<bool> KinesisDeviceRegistry::StartOpen(const std::string& serialNo)
+{
+	Entry& entry = devices_[serialNo];
+	if (!entry.opened.valid())
+		entry.opened = std::async(std::launch::async, &KinesisDeviceRegistry::OpenDevice, serialNo,
+			&entry.settings, &entry.fromCache).share();
+
+	return entry.opened;
 }
 
-int ThorlabsKinesisTCubeServo::Shutdown()
+/**
+* Opens the cube. If the settings cache matches the cube's firmware, the
+* cached settings are applied instead of having Kinesis load them, which is
+* the slow part of opening a cube.
+*/
+bool KinesisDeviceRegistry::OpenDevice(std::string serialNo, KinesisDeviceSettings* settings, bool* fromCache)
 {
+	if (CC_Open(serialNo.c_str()) != 0)
+		return false;
 
-	if (initialized_)
+	CC_StartPolling(serialNo.c_str(), g_PollingIntervalMs);
+
+	DWORD firmwareVersion = KinesisDeviceSettings::FirmwareVersion(serialNo);
+	if (firmwareVersion != 0 && settings->Load(serialNo) && settings->firmwareVersion == firmwareVersion)
 	{
-		initialized_ = false;
+		settings->ApplyToDevice(serialNo);
+		*fromCache = true;
+		return true;
 	}
-	CC_Close(serialNumber_.c_str());
-	return DEVICE_OK;
+
+	CC_LoadSettings(serialNo.c_str());
+	*fromCache = false;
+	if (settings->ReadFromDevice(serialNo) && firmwareVersion != 0)
+	{
+		settings->firmwareVersion = firmwareVersion;
+		settings->Save(serialNo);
+	}
+	return true;
 }
 
-bool ThorlabsKinesisTCubeServo::Busy()
+/**
+* Closes and reopens a cube that stopped answering, and gives it back the
+* settings it was opened with. The users of the cube keep their references.
+*/
+bool KinesisDeviceRegistry::Reconnect(const std::string& serialNo)
 {
-	int resp = CC_RequestStatusBits(serialNumber_.c_str());
-	Sleep(200);
-	DWORD status = CC_GetStatusBits(serialNumber_.c_str());
-	unsigned short isMovingCW = (status & 0x00000010);
-	unsigned short isMovingCCW = (status & 0x00000020);
-	bool isBusy = (bool)(isMovingCW || isMovingCCW);
+	KinesisDeviceSettings settings;
+	bool haveSettings = false;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		std::map<std::string, Entry>::iterator it = devices_.find(serialNo);
+		if (it == devices_.end() || it->second.refCount == 0)
+			return false;
+		settings = it->second.settings;
+		haveSettings = it->second.settings.countsPerMm > 0.0;
+	}
 
-	return (bool)(isBusy);
+	const char* sn = serialNo.c_str();
+	CC_StopPolling(sn);
+	CC_Close(sn);
+	if (CC_Open(sn) != 0)
+		return false;
+
+	CC_StartPolling(sn, g_PollingIntervalMs);
+	if (haveSettings)
+		settings.ApplyToDevice(serialNo);
+	else
+		CC_LoadSettings(sn);
+	return true;
 }
 
-int ThorlabsKinesisTCubeServo::GetPositionUm(double& posUm)
+/**
+* Returns the settings of an open cube, and whether they came from the cache.
+*/
+bool KinesisDeviceRegistry::GetSettings(const std::string& serialNo, KinesisDeviceSettings& settings, bool& fromCache)
 {
+	std::lock_guard<std::mutex> guard(lock_);
+	std::map<std::string, Entry>::iterator it = devices_.find(serialNo);
+	if (it == devices_.end() || !it->second.opened.valid() ||
+		it->second.opened.wait_for(std::chrono::seconds(0)) != std::future_status::ready || !it->second.opened.get())
+		return false;
+
+	settings = it->second.settings;
+	fromCache = it->second.fromCache;
+	return true;
+}
 
-	pfPosition = CC_GetPosition(serialNumber_.c_str());
+///////////////////////////////////////////////////////////////////////////////
+// KinesisDeviceSettings class
+///////////////////////////////////////////////////////////////////////////////
 
-	curPosUm_ = (double)pfPosition / 34304 * 1000;
-	posUm = curPosUm_;
+KinesisDeviceSettings::KinesisDeviceSettings() :
+	firmwareVersion(0),
+	stepsPerRev(0.0),
+	gearBoxRatio(0.0),
+	pitch(0.0),
+	minPositionMm(0.0),
+	maxPositionMm(0.0),
+	maxVelocity(0.0),
+	maxAcceleration(0.0),
+	countsPerMm(0.0)
+{
+	memset(&velParams, 0, sizeof(velParams));
+	memset(&jogParams, 0, sizeof(jogParams));
+	memset(&homingParams, 0, sizeof(homingParams));
+}
 
-	tmpMessage << "GetPositionUm:" << curPosUm_;
-	LogIt();
+/**
+* Reads back what CC_LoadSettings gave the DLL and the controller.
+*/
+bool KinesisDeviceSettings::ReadFromDevice(const std::string& serialNo)
+{
+	const char* sn = serialNo.c_str();
+	if (CC_GetMotorParamsExt(sn, &stepsPerRev, &gearBoxRatio, &pitch) != 0)
+		return false;
+	CC_GetMotorTravelLimits(sn, &minPositionMm, &maxPositionMm);
+	CC_GetMotorVelocityLimits(sn, &maxVelocity, &maxAcceleration);
+	CC_GetVelParamsBlock(sn, &velParams);
+	CC_GetJogParamsBlock(sn, &jogParams);
+	CC_GetHomingParamsBlock(sn, &homingParams);
+
+	KinesisUnitScale scale;
+	if (ResolveKinesisUnitScale(serialNo, g_StageProfileAuto, scale) != DEVICE_OK)
+		return false;
+	countsPerMm = scale.CountsPerMm();
+	return true;
+}
 
-	return DEVICE_OK;
+/**
+* Does what CC_LoadSettings would: the motor parameters and limits go to
+* the DLL, the velocity, jog and homing blocks to the controller.
+*/
+void KinesisDeviceSettings::ApplyToDevice(const std::string& serialNo) const
+{
+	const char* sn = serialNo.c_str();
+	CC_SetMotorParamsExt(sn, stepsPerRev, gearBoxRatio, pitch);
+	CC_SetMotorTravelLimits(sn, minPositionMm, maxPositionMm);
+	CC_SetMotorVelocityLimits(sn, maxVelocity, maxAcceleration);
+
+	MOT_VelocityParameters vel = velParams;
+	MOT_JogParameters jog = jogParams;
+	MOT_HomingParameters homing = homingParams;
+	CC_SetVelParamsBlock(sn, &vel);
+	CC_SetJogParamsBlock(sn, &jog);
+	CC_SetHomingParamsBlock(sn, &homing);
 }
 
-int ThorlabsKinesisTCubeServo::SetPositionUm(double posUm)
+bool KinesisDeviceSettings::Load(const std::string& serialNo)
 {
-	return SetPositionUmFlag(posUm, 1);
+	FILE* file = fopen(CachePath(serialNo).c_str(), "r");
+	if (!file)
+		return false;
+
+	std::map<std::string, double> values;
+	char line[128];
+	while (fgets(line, sizeof(line), file))
+	{
+		char key[64];
+		double value;
+		if (sscanf(line, "%63[^=]=%lf", key, &value) == 2)
+			values[key] = value;
+	}
+	fclose(file);
+
+	const char* keys[] = { "firmwareVersion", "stepsPerRev", "gearBoxRatio", "pitch", "minPositionMm", "maxPositionMm",
+		"maxVelocity", "maxAcceleration", "countsPerMm", "vel.minVelocity", "vel.acceleration", "vel.maxVelocity",
+		"jog.mode", "jog.stepSize", "jog.minVelocity", "jog.acceleration", "jog.maxVelocity", "jog.stopMode",
+		"homing.direction", "homing.limitSwitch", "homing.velocity", "homing.offsetDistance" };
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+	{
+		if (values.find(keys[i]) == values.end())
+			return false;
+	}
+
+	firmwareVersion = (DWORD)values["firmwareVersion"];
+	stepsPerRev = values["stepsPerRev"];
+	gearBoxRatio = values["gearBoxRatio"];
+	pitch = values["pitch"];
+	minPositionMm = values["minPositionMm"];
+	maxPositionMm = values["maxPositionMm"];
+	maxVelocity = values["maxVelocity"];
+	maxAcceleration = values["maxAcceleration"];
+	countsPerMm = values["countsPerMm"];
+	velParams.minVelocity = (int)values["vel.minVelocity"];
+	velParams.acceleration = (int)values["vel.acceleration"];
+	velParams.maxVelocity = (int)values["vel.maxVelocity"];
+	jogParams.mode = (MOT_JogModes)(short)values["jog.mode"];
+	jogParams.stepSize = (unsigned int)values["jog.stepSize"];
+	jogParams.velParams.minVelocity = (int)values["jog.minVelocity"];
+	jogParams.velParams.acceleration = (int)values["jog.acceleration"];
+	jogParams.velParams.maxVelocity = (int)values["jog.maxVelocity"];
+	jogParams.stopMode = (MOT_StopModes)(short)values["jog.stopMode"];
+	homingParams.direction = (MOT_TravelDirection)(short)values["homing.direction"];
+	homingParams.limitSwitch = (MOT_HomeLimitSwitchDirection)(short)values["homing.limitSwitch"];
+	homingParams.velocity = (unsigned int)values["homing.velocity"];
+	homingParams.offsetDistance = (unsigned int)values["homing.offsetDistance"];
+	return true;
 }
 
-int ThorlabsKinesisTCubeServo::SetPositionUmContinuous(double posUm)
+bool KinesisDeviceSettings::Save(const std::string& serialNo) const
 {
-	return SetPositionUmFlag(posUm, 1);
+	FILE* file = fopen(CachePath(serialNo).c_str(), "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "firmwareVersion=%lu\n", (unsigned long)firmwareVersion);
+	fprintf(file, "stepsPerRev=%.17g\ngearBoxRatio=%.17g\npitch=%.17g\n", stepsPerRev, gearBoxRatio, pitch);
+	fprintf(file, "minPositionMm=%.17g\nmaxPositionMm=%.17g\n", minPositionMm, maxPositionMm);
+	fprintf(file, "maxVelocity=%.17g\nmaxAcceleration=%.17g\n", maxVelocity, maxAcceleration);
+	fprintf(file, "countsPerMm=%.17g\n", countsPerMm);
+	fprintf(file, "vel.minVelocity=%d\nvel.acceleration=%d\nvel.maxVelocity=%d\n",
+		velParams.minVelocity, velParams.acceleration, velParams.maxVelocity);
+	fprintf(file, "jog.mode=%d\njog.stepSize=%u\njog.minVelocity=%d\njog.acceleration=%d\njog.maxVelocity=%d\njog.stopMode=%d\n",
+		(int)jogParams.mode, jogParams.stepSize, jogParams.velParams.minVelocity, jogParams.velParams.acceleration,
+		jogParams.velParams.maxVelocity, (int)jogParams.stopMode);
+	fprintf(file, "homing.direction=%d\nhoming.limitSwitch=%d\nhoming.velocity=%u\nhoming.offsetDistance=%u\n",
+		(int)homingParams.direction, (int)homingParams.limitSwitch, homingParams.velocity, homingParams.offsetDistance);
+	return fclose(file) == 0;
 }
 
-int ThorlabsKinesisTCubeServo::SetOrigin()
+/**
+* One file per cube, in the user's local application data folder (the
+* temporary folder if that is not set).
+*/
+std::string KinesisDeviceSettings::CachePath(const std::string& serialNo)
 {
-	return DEVICE_UNSUPPORTED_COMMAND;
+	std::string dir;
+	const char* appData = getenv("LOCALAPPDATA");
+	if (appData && *appData)
+	{
+		dir = std::string(appData) + "\\";
+	}
+	else
+	{
+		char tempPath[MAX_PATH];
+		DWORD length = GetTempPathA(MAX_PATH, tempPath);
+		if (length > 0 && length < MAX_PATH)
+			dir = tempPath;
+	}
+	return dir + "ThorlabsKinesisTCubeServo-" + serialNo + ".settings";
 }
 
-int ThorlabsKinesisTCubeServo::SetPositionSteps(long steps)
+/**
+* Firmware version reported by the cube, 0 if it cannot be read.
+*/
+DWORD KinesisDeviceSettings::FirmwareVersion(const std::string& serialNo)
 {
-	steps = (long)0.1;
-	return DEVICE_OK;
+	TLI_HardwareInformation info;
+	if (CC_GetHardwareInfoBlock(serialNo.c_str(), &info) != 0)
+		return 0;
+	return info.firmwareVersion;
 }
 
-int ThorlabsKinesisTCubeServo::GetPositionSteps(long& steps)
+///////////////////////////////////////////////////////////////////////////////
+// KinesisHistogram class
+///////////////////////////////////////////////////////////////////////////////
+
+int KinesisHistogram::BucketIndex(unsigned long long value)
 {
-	stepSizeUm_ = steps;
-	return DEVICE_OK;
+	if (value < SubBuckets)
+		return (int)value;
+
+	int octave = 0;
+	for (unsigned long long v = value; v > 1; v >>= 1)
+		octave++;
+
+	int index = (octave - 2) * SubBuckets + (int)((value >> (octave - 3)) & (SubBuckets - 1));
+	return index < NumBuckets ? index : NumBuckets - 1;
 }
 
-int ThorlabsKinesisTCubeServo::GetLimits(double& min, double& max)
+double KinesisHistogram::BucketMidpoint(int index)
 {
+	if (index < SubBuckets)
+		return index;
 
-	tmpMessage << "In GetLimits(). chNumber:" << chNumber_ << " pfMinPos:" << pfMinPos << " pfMaxPos:" << pfMaxPos; //<< " plUnits:" << plUnits << " pfPitch:" << pfPitch;
-	LogIt();
+	int octave = index / SubBuckets + 2;
+	double width = (double)(1ULL << (octave - 3));
+	return (SubBuckets + index % SubBuckets) * width + width / 2;
+}
 
+void KinesisHistogram::Record(unsigned long long value)
+{
+	buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
 
-	min = minTravelUm_;
-	max = maxTravelUm_;
+	unsigned long long currentMax = max_.load(std::memory_order_relaxed);
+	while (value > currentMax && !max_.compare_exchange_weak(currentMax, value, std::memory_order_relaxed))
+		;
+}
 
-	return DEVICE_OK;
+void KinesisHistogram::Reset()
+{
+	for (int i = 0; i < NumBuckets; i++)
+		buckets_[i].store(0, std::memory_order_relaxed);
+	max_.store(0, std::memory_order_relaxed);
 }
 
-int ThorlabsKinesisTCubeServo::SetLimits(double min, double max)
+unsigned long long KinesisHistogram::Count() const
 {
-	minTravelUm_ = min;
-	maxTravelUm_ = max;
-	return DEVICE_OK;
+	unsigned long long count = 0;
+	for (int i = 0; i < NumBuckets; i++)
+		count += buckets_[i].load(std::memory_order_relaxed);
+	return count;
 }
 
+/**
+* Returns the value below which the given fraction of the samples fall, at
+* the resolution of the buckets; 0 without samples.
+*/
+double KinesisHistogram::Percentile(double fraction) const
+{
+	unsigned long long count = Count();
+	if (count == 0)
+		return 0.0;
+
+	unsigned long long rank = (unsigned long long)std::ceil(fraction * count);
+	if (rank == 0)
+		rank = 1;
+
+	unsigned long long seen = 0;
+	for (int i = 0; i < NumBuckets; i++)
+	{
+		seen += buckets_[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+		{
+			double value = BucketMidpoint(i);
+			return value < (double)Max() ? value : (double)Max();
+		}
+	}
+	return (double)Max();
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-// private methods
+// KinesisSampleFile class
 ///////////////////////////////////////////////////////////////////////////////
 
-void ThorlabsKinesisTCubeServo::init(std::string deviceName, long chNumber)
+KinesisSampleFile::KinesisSampleFile() :
+	file_(INVALID_HANDLE_VALUE),
+	mapping_(0),
+	base_(0),
+	mappedSize_(0),
+	count_(0)
 {
-	long plNumUnits, plSerialNum;
-	int hola;
-	char serialNO[9];
-	deviceName_ = deviceName;
-	chNumber_ = chNumber;
-	InitializeDefaultErrorMessages();
+}
 
-	// set device specific error messages
-	// ------------------------------------
-	SetErrorText(ERR_UNRECOGNIZED_ANSWER, "Invalid response from the device.");
-	SetErrorText(ERR_UNSPECIFIED_ERROR, "Unspecified error occured.");
-	SetErrorText(ERR_RESPONSE_TIMEOUT, "Device timed-out: no response received withing expected time interval.");
-	SetErrorText(ERR_BUSY, "Device busy.");
-	SetErrorText(ERR_STAGE_NOT_ZEROED, "Zero sequence still in progress.\n"
-		"Wait for few more seconds before trying again."
-		"Zero sequence executes only once per power cycle.");
+bool KinesisSampleFile::Open(const std::string& path)
+{
+	Close();
 
-	// create pre-initialization properties
-	// ------------------------------------
+	file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file_ == INVALID_HANDLE_VALUE)
+		return false;
 
-	// Name
-	CreateProperty(MM::g_Keyword_Name, deviceName.c_str(), MM::String, true);
+	if (!Map(g_SampleFileChunk))
+	{
+		CloseHandle(file_);
+		file_ = INVALID_HANDLE_VALUE;
+		return false;
+	}
 
-	// Description (will be properly updated later from MOT_GetStageAxisInfo)
-	CreateProperty(MM::g_Keyword_Description, "Thorlabs Stage", MM::String, true);
+	KinesisRecordFileHeader* header = reinterpret_cast<KinesisRecordFileHeader*>(base_);
+	memcpy(header->magic, "KPS1", 4);
+	header->recordSize = sizeof(KinesisPositionSample);
+	header->recordCount = 0;
+	header->startUs = KinesisStatusCache::NowUs();
+	header->reserved = 0;
+	count_ = 0;
+	return true;
+}
 
-	CPropertyAction* pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPosition);
-	CreateFloatProperty(g_Keyword_Position, 0, false, pAct);
-	SetPropertyLimits(g_Keyword_Position, minTravelUm_, maxTravelUm_);
+/**
+* Flushes the mapping and trims the file to the records written.
+*/
+void KinesisSampleFile::Close()
+{
+	if (file_ == INVALID_HANDLE_VALUE)
+		return;
+
+	Unmap();
+	LARGE_INTEGER size;
+	size.QuadPart = sizeof(KinesisRecordFileHeader) + count_ * sizeof(KinesisPositionSample);
+	SetFilePointerEx(file_, size, 0, FILE_BEGIN);
+	SetEndOfFile(file_);
+	CloseHandle(file_);
+	file_ = INVALID_HANDLE_VALUE;
+}
 
-	// Serial Number
-	CPropertyAction* pAct1 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSerialNumber);
-	CreateProperty(g_SerialNumberProp, "", MM::Integer, false, pAct1, true);
-
-	// Add this device to the drop-down menu, creating the property if this is the first one.
-	short n = TLI_GetDeviceListSize();
-	if (TLI_BuildDeviceList() == 0)
-	{
-		short n = TLI_GetDeviceListSize();
-
-		char serialNos[100];
-		TLI_GetDeviceListByTypeExt(serialNos, 100, 83); // we are only capturing K-cube DC servo devices
-		char *next_token1 = NULL;
-		char *p = strtok_s(serialNos, ",", &next_token1);
-		while (p != NULL)
-		{
-			// Get and parse this device's serial number and description
-			TLI_DeviceInfo deviceInfo;
-			TLI_GetDeviceInfo(p, &deviceInfo);
-			char desc[65];
-			strncpy_s(desc, deviceInfo.description, 64);
-			desc[64] = '\0';
-
-			// serialNo has type c-string.
-			//char serialNo[9];
-			strncpy_s(serialNO, deviceInfo.serialNo, 8);
-			serialNO[8] = '\0';
-			if (CC_Open(serialNO) == 0)
-			{
-				// start the device polling at 200ms intervals
-				CC_StartPolling(serialNO, 200);
-				CC_LoadSettings(serialNO);
-			}
-			int i = 0;
+void KinesisSampleFile::Append(const KinesisPositionSample& sample)
+{
+	if (!base_)
+		return;
 
-			if (i == 0)
-			{
-				
-				CPropertyAction* pAct1 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSerialNumber);
-				CreateProperty(g_SerialNumberProp, serialNO, MM::String, false, pAct1, true);
-			}
-			AddAllowedValue(g_SerialNumberProp, serialNO);
-			i++;
-			p = strtok_s(NULL, ",", &next_token1);
+	unsigned long long offset = sizeof(KinesisRecordFileHeader) + count_ * sizeof(KinesisPositionSample);
+	if (offset + sizeof(KinesisPositionSample) > mappedSize_)
+	{
+		FlushViewOfFile(base_, 0);
+		Unmap();
+		if (!Map(mappedSize_ + g_SampleFileChunk))
+			return;
+	}
+
+	memcpy(base_ + offset, &sample, sizeof(sample));
+	count_++;
+	// the count goes last, so that a reader of the live file never sees a partial record
+	reinterpret_cast<KinesisRecordFileHeader*>(base_)->recordCount = count_;
+}
+
+bool KinesisSampleFile::Map(unsigned long long size)
+{
+	mapping_ = CreateFileMappingA(file_, 0, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)(size & 0xffffffff), 0);
+	if (!mapping_)
+		return false;
+
+	base_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, (size_t)size));
+	if (!base_)
+	{
+		CloseHandle(mapping_);
+		mapping_ = 0;
+		return false;
+	}
+	mappedSize_ = size;
+	return true;
+}
+
+void KinesisSampleFile::Unmap()
+{
+	if (base_)
+		UnmapViewOfFile(base_);
+	if (mapping_)
+		CloseHandle(mapping_);
+	base_ = 0;
+	mapping_ = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisPositionWatch class
+///////////////////////////////////////////////////////////////////////////////
+
+void KinesisPositionWatch::Reset(const std::string& serialNo)
+{
+	serialNo_ = serialNo;
+	counts_ = CC_GetPosition(serialNo_.c_str());
+	checkedUs_ = KinesisStatusCache::NowUs();
+	nextRequestUs_ = 0;
+}
 
+/**
+* Checks the local copy until it changes or the current request interval is
+* over. Returns false if no new position arrived in that time.
+*/
+bool KinesisPositionWatch::Next(KinesisPositionSample& sample, long intervalMs)
+{
+	long long nowUs = KinesisStatusCache::NowUs();
+	if (nowUs >= nextRequestUs_)
+	{
+		CC_RequestPosition(serialNo_.c_str());
+		nextRequestUs_ = nowUs + intervalMs * 1000LL;
+	}
+
+	while (true)
+	{
+		int counts = CC_GetPosition(serialNo_.c_str());
+		nowUs = KinesisStatusCache::NowUs();
+		if (counts != counts_)
+		{
+			sample.counts = counts;
+			sample.timestampUs = (checkedUs_ + nowUs) / 2;
+			sample.reserved = 0;
+			counts_ = counts;
+			checkedUs_ = nowUs;
+			return true;
 		}
+		checkedUs_ = nowUs;
+		if (nowUs >= nextRequestUs_)
+			return false;
+		std::this_thread::sleep_for(std::chrono::microseconds(g_PositionCheckIntervalUs));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisPositionSampler class
+///////////////////////////////////////////////////////////////////////////////
+
+KinesisPositionSampler::KinesisPositionSampler() :
+	intervalMs_(5),
+	head_(0),
+	tail_(0),
+	dropped_(0),
+	running_(false)
+{
+}
+
+/**
+* Starts asking for the position every intervalMs and recording each new
+* one, also streaming to filePath unless it is empty. Samples left in the
+* ring from an earlier run are discarded.
+*/
+bool KinesisPositionSampler::Start(const std::string& serialNo, long intervalMs, const std::string& filePath)
+{
+	Stop();
+
+	if (!filePath.empty() && !file_.Open(filePath))
+		return false;
+
+	watch_.Reset(serialNo);
+	intervalMs_ = intervalMs > 0 ? intervalMs : 1;
+	tail_.store(head_.load());
+	dropped_ = 0;
+	running_ = true;
+	thread_ = std::thread(&KinesisPositionSampler::Run, this);
+	return true;
+}
+
+void KinesisPositionSampler::Stop()
+{
+	running_ = false;
+	if (thread_.joinable())
+		thread_.join();
+	file_.Close();
+}
+
+/**
+* Moves up to maxSamples of the oldest samples out of the ring. Must only be
+* called from one thread at a time.
+*/
+size_t KinesisPositionSampler::Drain(KinesisPositionSample* samples, size_t maxSamples)
+{
+	size_t tail = tail_.load(std::memory_order_relaxed);
+	size_t head = head_.load(std::memory_order_acquire);
+	size_t count = head - tail;
+	if (count > maxSamples)
+		count = maxSamples;
+
+	for (size_t i = 0; i < count; i++)
+		samples[i] = ring_[(tail + i) & (Capacity - 1)];
+
+	tail_.store(tail + count, std::memory_order_release);
+	return count;
+}
+
+size_t KinesisPositionSampler::Pending() const
+{
+	return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+}
+
+void KinesisPositionSampler::Push(const KinesisPositionSample& sample)
+{
+	size_t head = head_.load(std::memory_order_relaxed);
+	if (head - tail_.load(std::memory_order_acquire) >= Capacity)
+	{
+		dropped_++;
+		return;
+	}
+
+	ring_[head & (Capacity - 1)] = sample;
+	head_.store(head + 1, std::memory_order_release);
+}
+
+void KinesisPositionSampler::Run()
+{
+	KinesisPositionSample sample;
+	while (running_)
+	{
+		if (!watch_.Next(sample, intervalMs_))
+			continue;
+
+		Push(sample);
+		file_.Append(sample);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisTimeline class
+///////////////////////////////////////////////////////////////////////////////
+
+KinesisTimeline::KinesisTimeline() :
+	enabled_(false),
+	dropped_(0)
+{
+}
+
+/**
+* Records a command right before it is sent to the cube.
+*/
+void KinesisTimeline::RecordCommand(Command command, int data)
+{
+	if (!enabled_)
+		return;
+
+	KinesisTimelineEvent event;
+	event.timestampUs = KinesisStatusCache::NowUs();
+	event.type = CommandType;
+	event.id = (unsigned short)command;
+	event.data = data;
+	Append(event);
+}
+
+/**
+* Records a message as it is taken off the Kinesis message queue.
+*/
+void KinesisTimeline::RecordMessage(unsigned short type, unsigned short id, int data)
+{
+	if (!enabled_)
+		return;
+
+	KinesisTimelineEvent event;
+	event.timestampUs = KinesisStatusCache::NowUs();
+	event.type = type;
+	event.id = id;
+	event.data = data;
+	Append(event);
+}
+
+void KinesisTimeline::Append(const KinesisTimelineEvent& event)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	if (events_.size() >= Capacity)
+	{
+		dropped_++;
+		return;
+	}
+	events_.push_back(event);
+}
+
+size_t KinesisTimeline::Size()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	return events_.size();
+}
+
+/**
+* Writes the current chunk to path, as CSV if the name ends in ".csv" and as
+* binary records otherwise, and starts a new chunk. The events stay in place
+* if the file cannot be written.
+*/
+bool KinesisTimeline::Export(const std::string& path)
+{
+	std::vector<KinesisTimelineEvent> events;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		events.swap(events_);
+	}
+
+	std::string extension = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	bool csv = extension == ".csv";
+	FILE* file = fopen(path.c_str(), csv ? "w" : "wb");
+	bool written = file != 0;
+	if (file)
+	{
+		written = csv ? WriteCsv(file, events) : WriteBinary(file, events);
+		written = fclose(file) == 0 && written;
+	}
+	if (written)
+	{
+		dropped_ = 0;
+		return true;
 	}
-	/*for (int i = 0; i < n && n < 64; i++)
+
+	// put the chunk back in front of what was recorded meanwhile
+	std::lock_guard<std::mutex> guard(lock_);
+	events.insert(events.end(), events_.begin(), events_.end());
+	events.swap(events_);
+	return false;
+}
+
+bool KinesisTimeline::WriteCsv(FILE* file, const std::vector<KinesisTimelineEvent>& events)
+{
+	fprintf(file, "timestamp_us,source,type,id,data\n");
+	for (size_t i = 0; i < events.size(); i++)
 	{
-		if (i == 0)
+		const KinesisTimelineEvent& event = events[i];
+		if (event.type == CommandType)
 		{
-			
-			CPropertyAction* pAct1 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSerialNumber);
-			CreateProperty(g_SerialNumberProp, serialNo, MM::String, false, pAct1, true);
+			const char* name = event.id < sizeof(g_TimelineCommandNames) / sizeof(g_TimelineCommandNames[0]) ? g_TimelineCommandNames[event.id] : "";
+			fprintf(file, "%lld,command,,%s,%d\n", event.timestampUs, name, event.data);
 		}
-		AddAllowedValue(g_SerialNumberProp, serialNo);
-	}*/
-	
+		else
+			fprintf(file, "%lld,message,%u,%u,%d\n", event.timestampUs, (unsigned)event.type, (unsigned)event.id, event.data);
+	}
+	return ferror(file) == 0;
+}
 
-	//Populating the Channel drop-down menu (last one selected by default?)
-	CPropertyAction* pAct2 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnChannelNumber);
-	CreateProperty(g_ChannelProp, "1", MM::Integer, false, pAct2, true);
+bool KinesisTimeline::WriteBinary(FILE* file, const std::vector<KinesisTimelineEvent>& events)
+{
+	KinesisRecordFileHeader header;
+	memcpy(header.magic, "KTL1", 4);
+	header.recordSize = sizeof(KinesisTimelineEvent);
+	header.recordCount = events.size();
+	header.startUs = events.empty() ? KinesisStatusCache::NowUs() : events[0].timestampUs;
+	header.reserved = 0;
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		return false;
+	return events.empty() || fwrite(&events[0], sizeof(KinesisTimelineEvent), events.size(), file) == events.size();
+}
 
-	for (int i = 0; i < chNumber_; i++)
+///////////////////////////////////////////////////////////////////////////////
+// KinesisVelocityProfileCache class
+///////////////////////////////////////////////////////////////////////////////
+
+short KinesisVelocityProfileCache::Load()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	short ret = CC_GetVelParamsBlock(serialNo_.c_str(), &active_);
+	valid_ = (ret == 0);
+	return ret;
+}
+
+/**
+* Writes the profile to the controller, unless it holds it already.
+*/
+short KinesisVelocityProfileCache::Apply(const MOT_VelocityParameters& params)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	if (valid_ && active_.acceleration == params.acceleration && active_.maxVelocity == params.maxVelocity &&
+		active_.minVelocity == params.minVelocity)
+		return 0;
+
+	MOT_VelocityParameters toSend = params;
+	short ret = CC_SetVelParamsBlock(serialNo_.c_str(), &toSend);
+	valid_ = (ret == 0);
+	if (valid_)
+		active_ = params;
+	return ret;
+}
+
+MOT_VelocityParameters KinesisVelocityProfileCache::Active()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	return active_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisMovePlanner class
+///////////////////////////////////////////////////////////////////////////////
+
+KinesisMovePlanner::KinesisMovePlanner() :
+	shortThresholdUm_(0.0),
+	approachOvershootUm_(0.0)
+{
+}
+
+void KinesisMovePlanner::SetModels(const KinesisMoveTimeModel& defaultModel, const KinesisMoveTimeModel& shortModel,
+	double shortThresholdUm)
+{
+	defaultModel_ = defaultModel;
+	shortModel_ = shortModel;
+	shortThresholdUm_ = shortThresholdUm;
+}
+
+/**
+* Time of a single move, with the profile the adapter selects for its length.
+*/
+double KinesisMovePlanner::LegTimeMs(double distanceUm) const
+{
+	bool shortProfile = shortThresholdUm_ > 0.0 && distanceUm <= shortThresholdUm_;
+	return (shortProfile ? shortModel_ : defaultModel_).TravelTimeMs(distanceUm);
+}
+
+/**
+* Predicts the visit of the positions in plan.order, starting at startUm.
+*/
+void KinesisMovePlanner::Evaluate(const std::vector<double>& positionsUm, double startUm, KinesisMovePlan& plan) const
+{
+	plan.totalMs = 0.0;
+	plan.travelUm = 0.0;
+	plan.reversals = 0;
+
+	double fromUm = startUm;
+	int direction = 0;
+	for (size_t i = 0; i < plan.order.size(); i++)
 	{
-		AddAllowedValue(g_ChannelProp, CDeviceUtils::ConvertToString(i + 1));
+		double toUm = positionsUm[plan.order[i]];
+		double distanceUm = std::fabs(toUm - fromUm);
+
+		if (toUm < fromUm && approachOvershootUm_ > 0.0)
+		{
+			plan.totalMs += LegTimeMs(distanceUm + approachOvershootUm_) + LegTimeMs(approachOvershootUm_);
+			plan.travelUm += distanceUm + 2 * approachOvershootUm_;
+		}
+		else
+		{
+			plan.totalMs += LegTimeMs(distanceUm);
+			plan.travelUm += distanceUm;
+		}
+
+		if (toUm != fromUm)
+		{
+			int segmentDirection = toUm > fromUm ? 1 : -1;
+			if (direction != 0 && segmentDirection != direction)
+				plan.reversals++;
+			direction = segmentDirection;
+		}
+		fromUm = toUm;
 	}
-	chNumber_ = 1;
+}
 
-	//Populating the min and max values for min travel
+/**
+* Keep Order only predicts the given order. Shortest keeps the fastest of
+* the given, ascending and descending orders; on a line, the shortest visit
+* of all positions is always one of the two sweeps. Serpentine visits the
+* positions upwards and then back down, leaving out the top and bottom on
+* the way down since the sequence repeats, so it never has a long return
+* move and never stays on a position for two steps.
+*/
+KinesisMovePlan KinesisMovePlanner::Plan(const std::vector<double>& positionsUm, double startUm, Order order) const
+{
+	std::vector<size_t> given(positionsUm.size());
+	for (size_t i = 0; i < given.size(); i++)
+		given[i] = i;
 
-	//At this point in time, we do not know the real min and max travel.
-	//These depend on the serial number and channel and type of stage attached.
-	//Widely, 0-500000 um should cover the rotation stages as well (0-360*1000?)
-	//GetLimits(minTravelUm_, maxTravelUm_);
-	pfMinPos = (float)(minTravelUm_);
-	pfMaxPos = (float)(maxTravelUm_);
+	std::vector<size_t> ascending = given;
+	std::stable_sort(ascending.begin(), ascending.end(),
+		[&positionsUm](size_t a, size_t b) { return positionsUm[a] < positionsUm[b]; });
+	std::vector<size_t> descending(ascending.rbegin(), ascending.rend());
 
-	CPropertyAction* pAct3 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMinPosUm);
-	CreateProperty(g_MinPosProp, CDeviceUtils::ConvertToString(minTravelUm_), MM::Float, false, pAct3, true);
-	CreateProperty(g_MinPosProp, CDeviceUtils::ConvertToString(minTravelUm_), MM::Float, false, pAct3);
-	//SetPropertyLimits(g_MinPosProp, minTravelUm_, maxTravelUm_);
+	KinesisMovePlan plan;
+	switch (order)
+	{
+	case Ascending:
+		plan.order = ascending;
+		break;
+	case Descending:
+		plan.order = descending;
+		break;
+	case Serpentine:
+		plan.order = ascending;
+		if (descending.size() > 2)
+			plan.order.insert(plan.order.end(), descending.begin() + 1, descending.end() - 1);
+		break;
+	case Shortest:
+	{
+		const std::vector<size_t>* candidates[] = { &given, &ascending, &descending };
+		for (int i = 0; i < 3; i++)
+		{
+			KinesisMovePlan candidate;
+			candidate.order = *candidates[i];
+			Evaluate(positionsUm, startUm, candidate);
+			if (i == 0 || candidate.totalMs < plan.totalMs)
+				plan = candidate;
+		}
+		return plan;
+	}
+	default:
+		plan.order = given;
+		break;
+	}
 
-	CPropertyAction* pAct4 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMaxPosUm);
-	CreateProperty(g_MaxPosProp, CDeviceUtils::ConvertToString(maxTravelUm_), MM::Float, false, pAct4, true);
-	CreateProperty(g_MaxPosProp, CDeviceUtils::ConvertToString(maxTravelUm_), MM::Float, false, pAct4);
-	//SetPropertyLimits(g_MaxPosProp, minTravelUm_, maxTravelUm_);
+	Evaluate(positionsUm, startUm, plan);
+	return plan;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisStatusCache class
+///////////////////////////////////////////////////////////////////////////////
+
+KinesisStatusCache::KinesisStatusCache() :
+	stats_(0),
+	pollingMs_(0),
+	lastUpdateUs_(0),
+	sequence_(0),
+	position_(0),
+	statusBits_(0),
+	minVelocity_(0),
+	acceleration_(0),
+	maxVelocity_(0),
+	timestampUs_(0)
+{
+}
+
+long long KinesisStatusCache::NowUs()
+{
+	return (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-	/*/Populating the Trigger Mode drop-down menu
-	CPropertyAction* pAct5 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTrigMode);
-	CreateProperty(g_TrigModeProp, g_TrigModes[0], MM::String, false, pAct5);
+/**
+* Copies the values the Kinesis polling loop last received into the snapshot.
+* The CC_Get* calls used here only read the DLL's local copy, they do not
+* talk to the controller. updateReceived is set when a message has just
+* come with a status update.
+*/
+void KinesisStatusCache::Refresh(bool updateReceived)
+{
+	if (serialNo_.empty())
+		return;
+
+	KinesisStatusSnapshot snapshot;
+	long long startUs = NowUs();
+	snapshot.position = CC_GetPosition(serialNo_.c_str());
+	if (stats_)
+		stats_->metrics[KinesisLatencyStats::GetPosition].Record(NowUs() - startUs);
+	snapshot.statusBits = CC_GetStatusBits(serialNo_.c_str());
+	CC_GetVelParams(serialNo_.c_str(), &snapshot.velParams.acceleration, &snapshot.velParams.maxVelocity);
+	snapshot.velParams.minVelocity = 0;
+	Publish(snapshot, updateReceived);
+}
 
-	for (int i = 0; i <= trigModeNumber_; i++)
+/**
+* Used when the snapshot is older than the allowed age: asks the controller
+* for fresh values and waits for the reply to change the DLL's copy. An
+* unchanged copy cannot be told from a late reply, so it does not make the
+* snapshot any fresher than Refresh() would.
+*/
+void KinesisStatusCache::RequestAndRefresh()
+{
+	if (serialNo_.empty())
+		return;
+
+	KinesisStatusSnapshot last = Read();
+	CC_RequestPosition(serialNo_.c_str());
+	long long startUs = NowUs();
+	CC_RequestStatusBits(serialNo_.c_str());
+	if (stats_)
+		stats_->metrics[KinesisLatencyStats::RequestStatus].Record(NowUs() - startUs);
+
+	long long deadlineUs = startUs + g_StatusReplyTimeoutMs * 1000;
+	while (NowUs() < deadlineUs)
 	{
-		AddAllowedValue(g_TrigModeProp, g_TrigModes[i]);
+		if (CC_GetPosition(serialNo_.c_str()) != last.position ||
+			CC_GetStatusBits(serialNo_.c_str()) != last.statusBits)
+		{
+			Refresh(true);
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
 	}
-	trigModeNumber_ = 2;
+	Refresh();
+}
 
-	//Populating the Trigger Move drop-down menu
-	CPropertyAction* pAct6 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTrigMove);
-	CreateProperty(g_TrigMoveProp, g_TrigMoves[0], MM::String, false, pAct6);
+void KinesisStatusCache::Publish(KinesisStatusSnapshot& snapshot, bool updateReceived)
+{
+	std::lock_guard<std::mutex> guard(writeLock_);
+
+	long long nowUs = NowUs();
+	if (updateReceived || snapshot.position != position_.load(std::memory_order_relaxed) ||
+		snapshot.statusBits != statusBits_.load(std::memory_order_relaxed))
+		lastUpdateUs_ = nowUs;
+	// while polling, the copy is never older than one interval
+	snapshot.timestampUs = lastUpdateUs_;
+	long pollingMs = pollingMs_;
+	if (pollingMs > 0 && nowUs - pollingMs * 1000LL > snapshot.timestampUs)
+		snapshot.timestampUs = nowUs - pollingMs * 1000LL;
+
+	unsigned seq = sequence_.load(std::memory_order_relaxed);
+	sequence_.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	position_.store(snapshot.position, std::memory_order_relaxed);
+	statusBits_.store(snapshot.statusBits, std::memory_order_relaxed);
+	minVelocity_.store(snapshot.velParams.minVelocity, std::memory_order_relaxed);
+	acceleration_.store(snapshot.velParams.acceleration, std::memory_order_relaxed);
+	maxVelocity_.store(snapshot.velParams.maxVelocity, std::memory_order_relaxed);
+	timestampUs_.store(snapshot.timestampUs, std::memory_order_relaxed);
+
+	sequence_.store(seq + 2, std::memory_order_release);
+}
 
-	for (int i = 0; i <= trigMoveNumber_; i++)
+KinesisStatusSnapshot KinesisStatusCache::Read() const
+{
+	KinesisStatusSnapshot snapshot;
+	unsigned before, after;
+	do
 	{
-		AddAllowedValue(g_TrigMoveProp, g_TrigMoves[i]);
+		before = sequence_.load(std::memory_order_acquire);
+		snapshot.position = position_.load(std::memory_order_relaxed);
+		snapshot.statusBits = statusBits_.load(std::memory_order_relaxed);
+		snapshot.velParams.minVelocity = minVelocity_.load(std::memory_order_relaxed);
+		snapshot.velParams.acceleration = acceleration_.load(std::memory_order_relaxed);
+		snapshot.velParams.maxVelocity = maxVelocity_.load(std::memory_order_relaxed);
+		snapshot.timestampUs = timestampUs_.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		after = sequence_.load(std::memory_order_relaxed);
+	} while ((before & 1) || before != after);
+
+	return snapshot;
+}
+
+double KinesisStatusCache::AgeMs() const
+{
+	return (NowUs() - timestampUs_.load(std::memory_order_relaxed)) / 1000.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisMoveTracker class
+///////////////////////////////////////////////////////////////////////////////
+
+std::mutex KinesisMoveTracker::registryLock_;
+std::vector<KinesisMoveTracker*> KinesisMoveTracker::registry_;
+
+KinesisMoveTracker::KinesisMoveTracker() :
+	statusCache_(0),
+	moving_(false),
+	graceMs_(2 * g_PollingIntervalMs),
+	stats_(0),
+	timeline_(0),
+	moveStartUs_(0),
+	busyPolls_(0),
+	settling_(false),
+	settleGeneration_(0),
+	settleWorkerRunning_(false),
+	pollingMs_(g_PollingIntervalMs),
+	idlePollingMs_(g_PollingIntervalMs),
+	movingPollingMs_(g_MovingPollingIntervalMs),
+	pollingFast_(false)
+{
+}
+
+KinesisMoveTracker::~KinesisMoveTracker()
+{
+	Detach();
+}
+
+void KinesisMoveTracker::Attach(const std::string& serialNo, long pollingMs, KinesisStatusCache* statusCache)
+{
+	Detach();
+
+	// the registry started polling at the idle rate
+	serialNo_ = serialNo;
+	pollingMs_ = idlePollingMs_ = pollingMs;
+	pollingFast_ = false;
+	statusCache_ = statusCache;
+	if (statusCache_)
+		statusCache_->SetPollingInterval(pollingMs);
+	moving_ = false;
+
+	CC_ClearMessageQueue(serialNo_.c_str());
+	{
+		std::lock_guard<std::mutex> guard(registryLock_);
+		registry_.push_back(this);
+	}
+	CC_RegisterMessageCallback(serialNo_.c_str(), &KinesisMoveTracker::OnKinesisMessage);
+
+	settleWorkerRunning_ = true;
+	settleWorker_ = std::thread(&KinesisMoveTracker::RunSettleWorker, this);
+}
+
+void KinesisMoveTracker::Detach()
+{
+	{
+		std::lock_guard<std::mutex> guard(registryLock_);
+		for (std::vector<KinesisMoveTracker*>::iterator it = registry_.begin(); it != registry_.end(); ++it)
+		{
+			if (*it == this)
+			{
+				registry_.erase(it);
+				break;
+			}
+		}
 	}
-	trigMoveNumber_ = 2;
 
-	//Populating the Move relative Step Size menu
-	CPropertyAction* pAct7 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMoveRel);
-	CreateProperty(g_MoveRelProp, CDeviceUtils::ConvertToString(moveRelStep_), MM::Float, false, pAct7);
-	SetPropertyLimits(g_MoveRelProp, 1, 1000);*/
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		settleWorkerRunning_ = false;
+	}
+	settleCond_.notify_all();
+	if (settleWorker_.joinable())
+		settleWorker_.join();
+}
+
+/**
+* Hooks the message callback up again after the cube was reopened. A move
+* in flight is given up, its completion message will not come.
+*/
+void KinesisMoveTracker::Reconnected()
+{
+	CC_ClearMessageQueue(serialNo_.c_str());
+	CC_RegisterMessageCallback(serialNo_.c_str(), &KinesisMoveTracker::OnKinesisMessage);
+	MoveAborted();
+	// the registry restarted polling at its default rate
+	ApplyPolling(false, true);
+}
+
+void KinesisMoveTracker::SetSettleConfig(const KinesisSettleConfig& config)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	settleConfig_ = config;
+}
+
+KinesisSettleConfig KinesisMoveTracker::SettleConfig()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	return settleConfig_;
+}
+
+/**
+* Sets the polling rates used while idle and during moves. Setting both to
+* the same value turns adaptive polling off.
+*/
+void KinesisMoveTracker::SetPollingIntervals(long idleMs, long movingMs)
+{
+	idlePollingMs_ = idleMs;
+	movingPollingMs_ = movingMs;
+	ApplyPolling(pollingFast_, true);
+}
+
+/**
+* Restarts the Kinesis polling loop at the moving or the idle rate. The idle
+* rate is only applied while no move is in progress, so a move started
+* meanwhile keeps its fast polling.
+*/
+void KinesisMoveTracker::ApplyPolling(bool fast, bool force)
+{
+	std::lock_guard<std::mutex> guard(pollingLock_);
+	if (!fast && moving_)
+		return;
+	if (fast == pollingFast_ && !force)
+		return;
+
+	long intervalMs = fast ? movingPollingMs_ : idlePollingMs_;
+	pollingFast_ = fast;
+	if (intervalMs == pollingMs_ && !force)
+		return;
+	CC_StartPolling(serialNo_.c_str(), intervalMs);
+	pollingMs_ = intervalMs;
+	if (statusCache_)
+		statusCache_->SetPollingInterval(intervalMs);
+}
+
+/**
+* Called by the adapter right before a move or home command is sent.
+* When the expected duration of the move is known, the status bits are not
+* looked at before it has (nearly) elapsed. The cube is polled at the moving
+* rate from here on, so the completion is seen sooner.
+*/
+void KinesisMoveTracker::MoveStarted(double expectedMs)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		moving_ = true;
+		lastCheck_ = std::chrono::steady_clock::now();
+		moveStartUs_ = KinesisStatusCache::NowUs();
+		busyPolls_ = 0;
+		settling_ = false;
+		graceMs_ = 2 * movingPollingMs_;
+		double predictedMs = expectedMs * (1.0 + g_MoveTimeMargin) + movingPollingMs_;
+		if (predictedMs > graceMs_)
+			graceMs_ = (long)predictedMs;
+	}
+	ApplyPolling(true);
+}
+
+/**
+* Called when the controller refused the command, so no message will follow.
+*/
+void KinesisMoveTracker::MoveAborted()
+{
+	MoveFinished();
+}
+
+/**
+* Returns the cached moving state. Only if no completion message arrived for
+* longer than the grace period (two polling periods, or the predicted move
+* time) are the status bits (kept up to date by the Kinesis polling loop)
+* checked, in case a message was dropped.
+*/
+bool KinesisMoveTracker::IsMoving()
+{
+	if (!moving_)
+		return false;
+
+	busyPolls_++;
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		long sinceCheckMs = (long)std::chrono::duration_cast<std::chrono::milliseconds>(now - lastCheck_).count();
+		if (sinceCheckMs < graceMs_)
+			return true;
+		lastCheck_ = now;
+		graceMs_ = 2 * pollingMs_;
+	}
+
+	// the settle worker has its own timeout
+	if (settling_)
+		return true;
+
+	if (StatusBitsIdle())
+		MoveFinished();
+
+	return moving_;
+}
+
+/**
+* Blocks until the "moved" / "homed" message arrives or the timeout expires.
+* Returns false on timeout.
+*/
+bool KinesisMoveTracker::WaitForMoveComplete(long timeoutMs)
+{
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+	while (IsMoving())
+	{
+		std::unique_lock<std::mutex> lk(lock_);
+		std::chrono::steady_clock::time_point wakeUp =
+			std::chrono::steady_clock::now() + std::chrono::milliseconds(2 * pollingMs_);
+		if (wakeUp > deadline)
+			wakeUp = deadline;
+		moveDone_.wait_until(lk, wakeUp, [this] { return !moving_; });
+		if (std::chrono::steady_clock::now() >= deadline)
+			return !moving_;
+	}
+	return true;
+}
+
+void KinesisMoveTracker::OnKinesisMessage()
+{
+	std::lock_guard<std::mutex> guard(registryLock_);
+	for (size_t i = 0; i < registry_.size(); i++)
+		registry_[i]->ProcessMessages();
+}
+
+void KinesisMoveTracker::ProcessMessages()
+{
+	WORD messageType, messageId;
+	DWORD messageData;
+
+	while (CC_MessageQueueSize(serialNo_.c_str()) > 0)
+	{
+		if (!CC_GetNextMessage(serialNo_.c_str(), &messageType, &messageId, &messageData))
+			break;
+		if (timeline_)
+			timeline_->RecordMessage(messageType, messageId, (int)messageData);
+
+		if (messageType != KINESIS_MSG_GENERIC_MOTOR)
+			continue;
+
+		if (messageId == KINESIS_MSG_MOVED || messageId == KINESIS_MSG_HOMED || messageId == KINESIS_MSG_STOPPED)
+		{
+			// publish the final position before waking up anyone waiting on the move
+			if (statusCache_)
+				statusCache_->Refresh(true);
+			if (stats_ && moving_ && !settling_)
+				stats_->metrics[KinesisLatencyStats::MoveToMessage].Record(KinesisStatusCache::NowUs() - moveStartUs_);
+
+			// a stopped axis is not waited on, it will not reach its target anyway
+			if (messageId == KINESIS_MSG_MOVED && moving_ && SettleConfig().enabled)
+			{
+				StartSettling();
+				continue;
+			}
+			if (stats_ && moving_)
+				stats_->metrics[KinesisLatencyStats::BusyPolls].Record(busyPolls_);
+			MoveFinished();
+		}
+	}
+
+	if (statusCache_)
+		statusCache_->Refresh();
+}
+
+void KinesisMoveTracker::MoveFinished()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		moving_ = false;
+		settling_ = false;
+		idleSince_ = std::chrono::steady_clock::now();
+	}
+	moveDone_.notify_all();
+	// the settle worker drops the polling rate once the linger time is over
+	settleCond_.notify_all();
+}
+
+/**
+* Hands the end of the move over to the settle worker; the move is reported as
+* still in progress until the position has settled.
+*/
+void KinesisMoveTracker::StartSettling()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		settling_ = true;
+		settleGeneration_++;
+	}
+	settleCond_.notify_all();
+}
+
+void KinesisMoveTracker::RunSettleWorker()
+{
+	std::unique_lock<std::mutex> lk(lock_);
+	unsigned handled = settleGeneration_;
+	while (true)
+	{
+		auto wakeUp = [&] { return (settling_ && settleGeneration_ != handled) || !settleWorkerRunning_; };
+		if (pollingFast_ && !moving_)
+		{
+			if (!settleCond_.wait_until(lk, idleSince_ + std::chrono::milliseconds(g_FastPollingLingerMs), wakeUp))
+			{
+				// idle for the whole linger time
+				lk.unlock();
+				ApplyPolling(false);
+				lk.lock();
+				continue;
+			}
+		}
+		else
+			settleCond_.wait(lk, wakeUp);
+		if (!settleWorkerRunning_)
+			return;
+
+		handled = settleGeneration_;
+		KinesisSettleConfig config = settleConfig_;
+		lk.unlock();
+
+		long long startUs = KinesisStatusCache::NowUs();
+		bool settled = WaitForSettled(config);
+		if (statusCache_)
+			statusCache_->Refresh();
+		if (stats_ && settled)
+		{
+			stats_->metrics[KinesisLatencyStats::Settle].Record(KinesisStatusCache::NowUs() - startUs);
+			stats_->metrics[KinesisLatencyStats::BusyPolls].Record(busyPolls_);
+		}
+
+		lk.lock();
+		// a new move may have been started meanwhile
+		if (!settling_ || settleGeneration_ != handled)
+			continue;
+		lk.unlock();
+		MoveFinished();
+		lk.lock();
+	}
+}
+
+/**
+* Samples the position until it has stayed within the tolerance window for
+* the required number of consecutive samples. The window is centred on the
+* first sample of the current run, so it follows a servo that is still
+* creeping in. Returns false if the timeout expired or a new move started.
+*
+* Only new updates of the DLL's local copy count as samples: a changed value,
+* or an unchanged one once a whole polling interval has passed. No requests
+* are sent, and the window spans samples - 1 polls of the controller.
+*/
+bool KinesisMoveTracker::WaitForSettled(const KinesisSettleConfig& config)
+{
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(config.timeoutMs);
+
+	int anchor = 0;
+	int inWindow = 0;
+	int lastPosition = CC_GetPosition(serialNo_.c_str());
+	std::chrono::steady_clock::time_point lastChange = std::chrono::steady_clock::now();
+	while (settling_ && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		int position = CC_GetPosition(serialNo_.c_str());
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		// a changed value is a new update; an unchanged one only once a poll has passed
+		if (position == lastPosition && now - lastChange < std::chrono::milliseconds(pollingMs_))
+			continue;
+		lastPosition = position;
+		lastChange = now;
+
+		if (inWindow > 0 && std::abs(position - anchor) <= config.toleranceCounts)
+		{
+			if (++inWindow >= config.samples)
+				return true;
+		}
+		else
+		{
+			anchor = position;
+			inWindow = 1;
+		}
+	}
+	return false;
+}
+
+/**
+* Checks the bits the Kinesis polling loop last received. The snapshot is
+* refreshed from them first: it is otherwise only updated by messages, and
+* none arrive in the middle of a move.
+*/
+bool KinesisMoveTracker::StatusBitsIdle()
+{
+	DWORD status;
+	if (statusCache_)
+	{
+		statusCache_->Refresh();
+		status = statusCache_->Read().statusBits;
+	}
+	else
+		status = CC_GetStatusBits(serialNo_.c_str());
+	return (status & KINESIS_STATUS_IN_MOTION) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ThorlabsKinesisTCubeServo class
+// FIXME? as default initialises to TDC001 / 1 channel
+//
+ThorlabsKinesisTCubeServo::ThorlabsKinesisTCubeServo() :
+	hwType_(0),
+	deviceName_("ThorlabsKinesisTCubeServo"),
+	chNumber_(1),
+	stepSizeUm_(0.1),
+	initialized_(false),
+	busy_(false),
+	homed_(false),
+	answerTimeoutMs_(1000),
+	minTravelUm_(0.0),
+	maxTravelUm_(50000.0),
+	softLimitPolicy_(AllowPartialMoves),
+	curPosUm_(0.0),
+	stageProfile_(g_StageProfileAuto),
+	deviceAcquired_(false),
+	settingsValid_(false),
+	settingsFromCache_(false),
+	ccdT_(0.0),
+	mode_m(0),
+	trigMoveNumber_(1),
+	moveRelStep_(0.5),
+	trigAbsPosUm_(0.0),
+	relDistanceCounts_(0),
+	relDistanceValid_(false),
+	predictedCompletionUs_(0),
+	shortMoveThresholdCounts_(0),
+	scanStartUm_(0.0),
+	scanEndUm_(0.0),
+	scanVelocityUmPerS_(100.0),
+	scanFrameRateHz_(0.0),
+	scanStepUm_(1.0),
+	scanRunning_(false),
+	jogMode_(false),
+	jogStepUm_(0.5),
+	jogVelocityMmPerS_(0.5),
+	jogStepCounts_(0),
+	backlashCounts_(0),
+	approachFromBelow_(false),
+	approachOvershootUm_(10.0),
+	approachRunning_(false),
+	samplerIntervalMs_(5),
+	tunedPidValid_(false),
+	pidProfile_(g_PidFactory),
+	autoTuneStepUm_(5.0),
+	propertyRefreshHz_(5.0),
+	homeOnInitialize_(g_No),
+	needsHoming_(true),
+	homingRunning_(false),
+	homingProgress_(0),
+	homingStartCounts_(0),
+	logFlusherRunning_(false),
+	watchdogRunning_(false),
+	watchdogTimeoutMs_(2000),
+	connectionLost_(false),
+	reconnects_(0),
+	maxStatusAgeMs_(g_PollingIntervalMs),
+	sequenceable_(false),
+	sequenceOrder_(KinesisMovePlanner::KeepOrder),
+	sequenceRunning_(false),
+	asyncMoves_(false),
+	movePending_(false),
+	pendingTarget_(0),
+	moveWorkerRunning_(false)
+
+{
+	//use the TDC001 default
+	int hwType = 31;//HWTYPE_TDC001;
+	std::string deviceName = g_ThorlabsDeviceNameTDC001;
+	long chNumber = 1;
+
+	init(deviceName, chNumber);
+}
+
+ThorlabsKinesisTCubeServo::ThorlabsKinesisTCubeServo(std::string deviceName, long chNumber) :
+	hwType_(0),
+	deviceName_("ThorlabsKinesisTCubeServo"),
+	chNumber_(1),
+	stepSizeUm_(0.1),
+	initialized_(false),
+	busy_(false),
+	homed_(false),
+	answerTimeoutMs_(1000),
+	minTravelUm_(0.0),
+	maxTravelUm_(50000.0),
+	softLimitPolicy_(AllowPartialMoves),
+	curPosUm_(0.0),
+	stageProfile_(g_StageProfileAuto),
+	deviceAcquired_(false),
+	settingsValid_(false),
+	settingsFromCache_(false),
+	ccdT_(0.0),
+	mode_m(0),
+	trigMoveNumber_(1),
+	moveRelStep_(0.5),
+	trigAbsPosUm_(0.0),
+	relDistanceCounts_(0),
+	relDistanceValid_(false),
+	predictedCompletionUs_(0),
+	shortMoveThresholdCounts_(0),
+	scanStartUm_(0.0),
+	scanEndUm_(0.0),
+	scanVelocityUmPerS_(100.0),
+	scanFrameRateHz_(0.0),
+	scanStepUm_(1.0),
+	scanRunning_(false),
+	jogMode_(false),
+	jogStepUm_(0.5),
+	jogVelocityMmPerS_(0.5),
+	jogStepCounts_(0),
+	backlashCounts_(0),
+	approachFromBelow_(false),
+	approachOvershootUm_(10.0),
+	approachRunning_(false),
+	samplerIntervalMs_(5),
+	tunedPidValid_(false),
+	pidProfile_(g_PidFactory),
+	autoTuneStepUm_(5.0),
+	propertyRefreshHz_(5.0),
+	homeOnInitialize_(g_No),
+	needsHoming_(true),
+	homingRunning_(false),
+	homingProgress_(0),
+	homingStartCounts_(0),
+	logFlusherRunning_(false),
+	watchdogRunning_(false),
+	watchdogTimeoutMs_(2000),
+	connectionLost_(false),
+	reconnects_(0),
+	maxStatusAgeMs_(g_PollingIntervalMs),
+	sequenceable_(false),
+	sequenceOrder_(KinesisMovePlanner::KeepOrder),
+	sequenceRunning_(false),
+	asyncMoves_(false),
+	movePending_(false),
+	pendingTarget_(0),
+	moveWorkerRunning_(false)
+{
+	init(deviceName, chNumber);
+}
+
+ThorlabsKinesisTCubeServo::~ThorlabsKinesisTCubeServo()
+{
+	Shutdown();
+	// a cube that was prefetched but never initialized
+	KinesisDeviceRegistry::Instance().CancelPrefetch(serialNumber_);
+	KinesisDeviceRegistry::Instance().RemoveClient();
+}
+
+void ThorlabsKinesisTCubeServo::GetName(char* Name) const
+{
+	CDeviceUtils::CopyLimitedString(Name, deviceName_.c_str());
+}
+
+int ThorlabsKinesisTCubeServo::Initialize()
+{
+	int ret(DEVICE_OK);
+	int hola = 0;
+
+	//needed to get the hardware info
+	GetLimits(minTravelUm_, maxTravelUm_);
+
+	StartLogFlusher();
+
+	// as a peripheral of the hub, the cube is the one assigned to the Z axis
+	ThorlabsKinesisHub* hub = static_cast<ThorlabsKinesisHub*>(GetParentHub());
+	if (hub && !hub->GetAxisSerialNumber(ThorlabsKinesisHub::AxisZ).empty())
+		serialNumber_ = hub->GetAxisSerialNumber(ThorlabsKinesisHub::AxisZ);
+
+	if (!KinesisDeviceRegistry::Instance().Acquire(serialNumber_))
+		return DEVICE_NOT_CONNECTED;
+	deviceAcquired_ = true;
+	settingsValid_ = KinesisDeviceRegistry::Instance().GetSettings(serialNumber_, settings_, settingsFromCache_);
+
+	ret = ResolveUnitScale();
+	if (ret != DEVICE_OK)
+		return ret;
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "InitHWDevice()");
+
+	/////////
+
+	//MOT_GetVelParamLimits(serialNumber_, &pfMaxAccn, &pfMaxVel);
+	if (settingsValid_)
+	{
+		pfMaxVel = settings_.maxVelocity;
+		pfMaxAccn = settings_.maxAcceleration;
+	}
+	else
+	{
+		CC_GetMotorVelocityLimits(serialNumber_.c_str(), &pfMaxVel, &pfMaxAccn);
+	}
+
+	// stage travel range in mm, which bounds the soft limits
+	double minPositionMm = pfMinPos, maxPositionMm = pfMaxPos;
+	if (settingsValid_)
+	{
+		minPositionMm = settings_.minPositionMm;
+		maxPositionMm = settings_.maxPositionMm;
+	}
+	else
+	{
+		CC_GetMotorTravelLimits(serialNumber_.c_str(), &minPositionMm, &maxPositionMm);
+	}
+	if (maxPositionMm > minPositionMm)
+	{
+		pfMinPos = (float)minPositionMm;
+		pfMaxPos = (float)maxPositionMm;
+	}
+	ret = UpdateTravelLimits();
+	if (ret != DEVICE_OK)
+		return ret;
+	posUm_ = CC_GetPosition(serialNumber_.c_str());
+	statusCache_.SetSerialNo(serialNumber_);
+	statusCache_.SetLatencyStats(&latencyStats_);
+	statusCache_.RequestAndRefresh();
+	moveTracker_.SetLatencyStats(&latencyStats_);
+	moveTracker_.SetTimeline(&timeline_);
+	moveTracker_.Attach(serialNumber_, g_PollingIntervalMs, &statusCache_);
+
+	// the homed bit survives an adapter reload, only a power cycle clears it
+	needsHoming_ = !CC_CanMoveWithoutHomingFirst(serialNumber_.c_str());
+	homed_ = IsHomed();
+	KINESIS_LOG(KINESIS_LOG_INFO, "Homed:%d needs homing:%d", (int)homed_, (int)needsHoming_);
+
+	velocityCache_.SetSerialNo(serialNumber_);
+	velocityCache_.Load();
+	defaultVelocity_ = shortMoveVelocity_ = velocityCache_.Active();
+	UpdateMoveTimeModel();
+
+	CC_RequestDCPIDParams(serialNumber_.c_str());
+	CC_GetDCPIDParams(serialNumber_.c_str(), &factoryPid_);
+	KINESIS_LOG(KINESIS_LOG_INFO, "PID P:%d I:%d D:%d IL:%d", factoryPid_.proportionalGain, factoryPid_.integralGain,
+		factoryPid_.differentialGain, factoryPid_.integralLimit);
+
+	moveWorkerRunning_ = true;
+	moveWorker_ = std::thread(&ThorlabsKinesisTCubeServo::RunMoveWorker, this);
+	StartWatchdog();
+	KINESIS_LOG(KINESIS_LOG_INFO, "pfMaxAccn:%g pfMaxVel:%g", pfMaxAccn, pfMaxVel);
+
+	// READ ONLY PROPERTIES
+	CreateProperty(g_SerialNumberProp, serialNumber_.c_str(), MM::String, true);
+	CreateProperty(g_CountsPerMmProp, CDeviceUtils::ConvertToString(unitScale_.CountsPerMm()), MM::Float, true);
+	CreateProperty(g_SettingsSourceProp, settingsFromCache_ ? g_SettingsFromCache : g_SettingsFromKinesis, MM::String, true);
+	CreateProperty(g_MaxVelProp, CDeviceUtils::ConvertToString(pfMaxVel), MM::String, true);
+	CreateProperty(g_MaxAccnProp, CDeviceUtils::ConvertToString(pfMaxAccn), MM::String, true);
+
+	//Action Properties
+	CPropertyAction* pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPosition);
+	CPropertyAction* pAct2 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnVelocity);
+	CPropertyAction* pAct3 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnHome);
+	CPropertyAction* pAct4 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMinPosUm);
+	CPropertyAction* pAct5 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMaxPosUm);
+
+	CPropertyAction* pAct7 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTrigMove);
+	CPropertyAction* pAct8 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMoveRel);
+	CPropertyAction* pAct9 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTrigAbsPos);
+
+
+	CreateFloatProperty(g_Keyword_Position, 0, false, pAct);
+	SetPropertyLimits(g_Keyword_Position, minTravelUm_, maxTravelUm_);
+
+	CreateProperty(g_Keyword_Velocity, CDeviceUtils::ConvertToString(pfMaxVel), MM::Float, false, pAct2);
+	SetPropertyLimits(g_Keyword_Velocity, 0, pfMaxVel);
+
+	CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnVelocityProfile, ProfileDefaultAcceleration);
+	CreateProperty(g_AccelerationProp, "0", MM::Float, false, pActEx);
+	SetPropertyLimits(g_AccelerationProp, 0, pfMaxAccn);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnShortMoveThreshold);
+	CreateProperty(g_ShortMoveThresholdProp, "0", MM::Float, false, pAct);
+	SetPropertyLimits(g_ShortMoveThresholdProp, 0, 1000);
+
+	pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnVelocityProfile, ProfileShortVelocity);
+	CreateProperty(g_ShortMoveVelocityProp, "0", MM::Float, false, pActEx);
+	SetPropertyLimits(g_ShortMoveVelocityProp, 0, pfMaxVel);
+
+	pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnVelocityProfile, ProfileShortAcceleration);
+	CreateProperty(g_ShortMoveAccelerationProp, "0", MM::Float, false, pActEx);
+	SetPropertyLimits(g_ShortMoveAccelerationProp, 0, pfMaxAccn);
+
+	// 1 homes only if the controller is not homed yet, 2 always homes
+	CreateProperty(g_Keyword_Home, "0", MM::Integer, false, pAct3);
+	SetPropertyLimits(g_Keyword_Home, 0, 2);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnHomingState);
+	CreateProperty(g_HomingStateProp, g_HomingNotHomed, MM::String, true, pAct);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnHomingProgress);
+	CreateProperty(g_HomingProgressProp, "0", MM::Integer, true, pAct);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnAsyncMoves);
+	CreateProperty(g_AsyncMovesProp, g_No, MM::String, false, pAct);
+	AddAllowedValue(g_AsyncMovesProp, g_No);
+	AddAllowedValue(g_AsyncMovesProp, g_Yes);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSettleTime);
+	CreateProperty(g_SettleTimeProp, CDeviceUtils::ConvertToString(moveTimeModel_.settleMs), MM::Float, false, pAct);
+	SetPropertyLimits(g_SettleTimeProp, 0, 1000);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPredictedCompletion);
+	CreateProperty(g_PredictedCompletionProp, "0", MM::Float, true, pAct);
+
+	// settle detection
+	KinesisSettleConfig settleConfig = moveTracker_.SettleConfig();
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSettleDetection);
+	CreateProperty(g_SettleDetectionProp, settleConfig.enabled ? g_Yes : g_No, MM::String, false, pAct);
+	AddAllowedValue(g_SettleDetectionProp, g_No);
+	AddAllowedValue(g_SettleDetectionProp, g_Yes);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSettleTolerance);
+	CreateProperty(g_SettleToleranceProp, CDeviceUtils::ConvertToString(unitScale_.ToUm(settleConfig.toleranceCounts)), MM::Float, false, pAct);
+	SetPropertyLimits(g_SettleToleranceProp, 0, 10);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSettleSamples);
+	CreateProperty(g_SettleSamplesProp, CDeviceUtils::ConvertToString(settleConfig.samples), MM::Integer, false, pAct);
+	SetPropertyLimits(g_SettleSamplesProp, 2, 100);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSettleTimeout);
+	CreateProperty(g_SettleTimeoutProp, CDeviceUtils::ConvertToString(settleConfig.timeoutMs), MM::Integer, false, pAct);
+	SetPropertyLimits(g_SettleTimeoutProp, 0, 5000);
+
+	// adaptive polling
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPollingInterval);
+	CreateProperty(g_PollingIntervalProp, CDeviceUtils::ConvertToString(moveTracker_.IdlePollingMs()), MM::Integer, false, pAct);
+	SetPropertyLimits(g_PollingIntervalProp, 10, 1000);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMovingPollingInterval);
+	CreateProperty(g_MovingPollingIntervalProp, CDeviceUtils::ConvertToString(moveTracker_.MovingPollingMs()), MM::Integer, false, pAct);
+	SetPropertyLimits(g_MovingPollingIntervalProp, 10, 1000);
+
+	// servo loop tuning
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPidProfile);
+	CreateProperty(g_PidProfileProp, g_PidFactory, MM::String, false, pAct);
+	AddAllowedValue(g_PidProfileProp, g_PidFactory);
+	for (int i = 0; i < g_NumPidProfiles; i++)
+		AddAllowedValue(g_PidProfileProp, g_PidProfiles[i].name);
+	AddAllowedValue(g_PidProfileProp, g_PidAutoTuned);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPidAutoTuneStep);
+	CreateProperty(g_PidAutoTuneStepProp, CDeviceUtils::ConvertToString(autoTuneStepUm_), MM::Float, false, pAct);
+	SetPropertyLimits(g_PidAutoTuneStepProp, 0.1, 1000);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPidAutoTune);
+	CreateProperty(g_PidAutoTuneProp, "0", MM::Integer, false, pAct);
+	SetPropertyLimits(g_PidAutoTuneProp, 0, 1);
+
+	// continuous scan
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnScan);
+	CreateProperty(g_ScanProp, g_ScanIdle, MM::String, false, pAct);
+	AddAllowedValue(g_ScanProp, g_ScanIdle);
+	AddAllowedValue(g_ScanProp, g_ScanRunning);
+
+	pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnScanParam, ScanStart);
+	CreateProperty(g_ScanStartProp, CDeviceUtils::ConvertToString(scanStartUm_), MM::Float, false, pActEx);
+	pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnScanParam, ScanEnd);
+	CreateProperty(g_ScanEndProp, CDeviceUtils::ConvertToString(scanEndUm_), MM::Float, false, pActEx);
+	pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnScanParam, ScanVelocity);
+	CreateProperty(g_ScanVelocityProp, CDeviceUtils::ConvertToString(scanVelocityUmPerS_), MM::Float, false, pActEx);
+	SetPropertyLimits(g_ScanVelocityProp, 0, pfMaxVel * 1000);
+	pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnScanParam, ScanFrameRate);
+	CreateProperty(g_ScanFrameRateProp, CDeviceUtils::ConvertToString(scanFrameRateHz_), MM::Float, false, pActEx);
+	pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnScanParam, ScanStep);
+	CreateProperty(g_ScanStepProp, CDeviceUtils::ConvertToString(scanStepUm_), MM::Float, false, pActEx);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnScanSampleCount);
+	CreateProperty(g_ScanSampleCountProp, "0", MM::Integer, true, pAct);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnScanExport);
+	CreateProperty(g_ScanExportProp, "", MM::String, false, pAct);
+
+	// jog mode
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnJogMode);
+	CreateProperty(g_JogModeProp, g_No, MM::String, false, pAct);
+	AddAllowedValue(g_JogModeProp, g_No);
+	AddAllowedValue(g_JogModeProp, g_Yes);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnJogStep);
+	CreateProperty(g_JogStepProp, CDeviceUtils::ConvertToString(jogStepUm_), MM::Float, false, pAct);
+	SetPropertyLimits(g_JogStepProp, 0, 1000);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnJogVelocity);
+	CreateProperty(g_JogVelocityProp, CDeviceUtils::ConvertToString(jogVelocityMmPerS_), MM::Float, false, pAct);
+	SetPropertyLimits(g_JogVelocityProp, 0, pfMaxVel);
+
+	// approach strategy
+	CC_RequestBacklash(serialNumber_.c_str());
+	backlashCounts_ = (int)CC_GetBacklash(serialNumber_.c_str());
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnBacklash);
+	CreateProperty(g_BacklashProp, CDeviceUtils::ConvertToString(unitScale_.ToUm(backlashCounts_)), MM::Float, false, pAct);
+	SetPropertyLimits(g_BacklashProp, 0, 1000);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnApproachMode);
+	CreateProperty(g_ApproachModeProp, g_ApproachDirect, MM::String, false, pAct);
+	AddAllowedValue(g_ApproachModeProp, g_ApproachDirect);
+	AddAllowedValue(g_ApproachModeProp, g_ApproachFromBelow);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnApproachOvershoot);
+	CreateProperty(g_ApproachOvershootProp, CDeviceUtils::ConvertToString(approachOvershootUm_), MM::Float, false, pAct);
+	SetPropertyLimits(g_ApproachOvershootProp, 0, 1000);
+
+	// position sampler
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSampler);
+	CreateProperty(g_SamplerProp, g_No, MM::String, false, pAct);
+	AddAllowedValue(g_SamplerProp, g_No);
+	AddAllowedValue(g_SamplerProp, g_Yes);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSamplerInterval);
+	CreateProperty(g_SamplerIntervalProp, CDeviceUtils::ConvertToString(samplerIntervalMs_), MM::Integer, false, pAct);
+	SetPropertyLimits(g_SamplerIntervalProp, 1, 1000);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSamplerFile);
+	CreateProperty(g_SamplerFileProp, "", MM::String, false, pAct);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSamplerPending);
+	CreateProperty(g_SamplerPendingProp, "0", MM::Integer, true, pAct);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSamplerDropped);
+	CreateProperty(g_SamplerDroppedProp, "0", MM::Integer, true, pAct);
+
+	// motion timeline
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTimeline);
+	CreateProperty(g_TimelineProp, g_No, MM::String, false, pAct);
+	AddAllowedValue(g_TimelineProp, g_No);
+	AddAllowedValue(g_TimelineProp, g_Yes);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTimelineExport);
+	CreateProperty(g_TimelineExportProp, "", MM::String, false, pAct);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTimelineEvents);
+	CreateProperty(g_TimelineEventsProp, "0", MM::Integer, true, pAct);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnTimelineDropped);
+	CreateProperty(g_TimelineDroppedProp, "0", MM::Integer, true, pAct);
+
+	// latency statistics: p50 / p99 / max of each metric
+	for (int metric = 0; metric < KinesisLatencyStats::NumMetrics; metric++)
+	{
+		for (int stat = 0; stat < g_NumLatencyStats; stat++)
+		{
+			std::string name = std::string(g_LatencyMetricNames[metric]) + " " + g_LatencyStatNames[stat];
+			pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnLatencyStat, metric * g_NumLatencyStats + stat);
+			CreateProperty(name.c_str(), "0", MM::Float, true, pActEx);
+		}
+	}
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnResetStats);
+	CreateProperty(g_ResetStatsProp, "0", MM::Integer, false, pAct);
+	SetPropertyLimits(g_ResetStatsProp, 0, 1);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMaxStatusAge);
+	CreateProperty(g_MaxStatusAgeProp, CDeviceUtils::ConvertToString(maxStatusAgeMs_), MM::Float, false, pAct);
+	SetPropertyLimits(g_MaxStatusAgeProp, 0, 10000);
+
+	// stage sequence planning
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSequenceOrder);
+	CreateProperty(g_SequenceOrderProp, g_SequenceOrders[sequenceOrder_], MM::String, false, pAct);
+	for (int i = 0; i < g_NumSequenceOrders; i++)
+		AddAllowedValue(g_SequenceOrderProp, g_SequenceOrders[i]);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPositionList);
+	CreateProperty(g_PositionListProp, "", MM::String, false, pAct);
+
+	for (int i = 0; i < g_NumSequencePlanProps; i++)
+	{
+		pActEx = new CPropertyActionEx(this, &ThorlabsKinesisTCubeServo::OnSequencePlan, i);
+		CreateProperty(g_SequencePlanProps[i], "0", i == 2 ? MM::Integer : MM::Float, true, pActEx);
+	}
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPropertyRefreshRate);
+	CreateProperty(g_PropertyRefreshRateProp, CDeviceUtils::ConvertToString(propertyRefreshHz_), MM::Float, false, pAct);
+	SetPropertyLimits(g_PropertyRefreshRateProp, 0, 100);
+
+	//By now, we now more about the hardware. Lets set proper hardware limits for g_MinPosProp / g_MaxPosProp
+	//pfMinPos*1000 / pfMaxPos*1000 (the stage travel range in mm) are the absolute limits.
+
+	CreateProperty(g_MinPosProp, CDeviceUtils::ConvertToString(minTravelUm_), MM::Float, false, pAct4);
+	SetPropertyLimits(g_MinPosProp, pfMinPos * 1000, pfMaxPos * 1000);
+
+	CreateProperty(g_MaxPosProp, CDeviceUtils::ConvertToString(maxTravelUm_), MM::Float, false, pAct5);
+	SetPropertyLimits(g_MaxPosProp, pfMinPos * 1000, pfMaxPos * 1000);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSoftLimitPolicy);
+	CreateProperty(g_SoftLimitPolicyProp, g_SoftLimitPolicies[softLimitPolicy_], MM::String, false, pAct);
+	for (int i = 0; i < g_NumSoftLimitPolicies; i++)
+		AddAllowedValue(g_SoftLimitPolicyProp, g_SoftLimitPolicies[i]);
+
+	// connection watchdog
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnConnection);
+	CreateProperty(g_ConnectionProp, g_ConnectionOk, MM::String, true, pAct);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnWatchdogTimeout);
+	CreateProperty(g_WatchdogTimeoutProp, CDeviceUtils::ConvertToString(watchdogTimeoutMs_), MM::Integer, false, pAct);
+	SetPropertyLimits(g_WatchdogTimeoutProp, 0, 60000);
+
+	pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnReconnects);
+	CreateProperty(g_ReconnectsProp, "0", MM::Integer, true, pAct);
+
+	//Populating the Trigger Move drop-down menu
+	CreateProperty(g_TrigMoveProp, g_TrigMoves[0], MM::String, false, pAct7);
+	for (int i = 0; i <= trigMoveNumber_; i++)
+	{
+		AddAllowedValue(g_TrigMoveProp, g_TrigMoves[i]);
+	}
+
+	//Relative step / absolute target executed on a trigger
+	CreateProperty(g_MoveRelProp, CDeviceUtils::ConvertToString(moveRelStep_), MM::Float, false, pAct8);
+	SetPropertyLimits(g_MoveRelProp, 0, 1000);
+	CreateProperty(g_TrigAbsPosProp, CDeviceUtils::ConvertToString(trigAbsPosUm_), MM::Float, false, pAct9);
+	SetPropertyLimits(g_TrigAbsPosProp, minTravelUm_, maxTravelUm_);
+
+	if (homeOnInitialize_ == g_HomeBlocking)
+	{
+		ret = Home();
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+	else if (homeOnInitialize_ == g_HomeBackground)
+	{
+		if (!IsHomed())
+			StartBackgroundHoming();
+	}
+
+	GetPropertySnapshot(true);
+	ret = UpdateStatus();
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "all done");
+
+	if (ret != DEVICE_OK)
+		return ret;
+
+	initialized_ = true;
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::Shutdown()
+{
+
+	if (initialized_)
+	{
+		initialized_ = false;
+	}
+	StopStageSequence();
+	StopScan();
+	StopBackgroundHoming();
+	positionSampler_.Stop();
+	StopWatchdog();
+	StopMoveWorker();
+	StopLogFlusher();
+	moveTracker_.Detach();
+	if (deviceAcquired_)
+	{
+		KinesisDeviceRegistry::Instance().Release(serialNumber_);
+		deviceAcquired_ = false;
+	}
+	return DEVICE_OK;
+}
+
+bool ThorlabsKinesisTCubeServo::Busy()
+{
+	if (movePending_ || approachRunning_ || scanRunning_ || homingRunning_)
+		return true;
+
+	return moveTracker_.IsMoving();
+}
+
+/**
+* Blocks until the current move or home completes.
+* Wakes up on the Kinesis "moved" / "homed" message rather than on a timer.
+*/
+int ThorlabsKinesisTCubeServo::WaitForMoveComplete(long timeoutMs)
+{
+	if (!moveTracker_.WaitForMoveComplete(timeoutMs))
+		return ERR_RESPONSE_TIMEOUT;
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::GetPositionUm(double& posUm)
+{
+	// the last position received is stale, do not pass it on as current
+	if (connectionLost_)
+		return ERR_CONNECTION_LOST;
+
+	curPosUm_ = unitScale_.ToUm(GetStatus().position);
+	posUm = curPosUm_;
+
+	KINESIS_LOG(KINESIS_LOG_DEBUG, "GetPositionUm:%g", curPosUm_);
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::SetPositionUm(double posUm)
+{
+	return SetPositionUmFlag(posUm, 1);
+}
+
+int ThorlabsKinesisTCubeServo::SetPositionUmContinuous(double posUm)
+{
+	return SetPositionUmFlag(posUm, 1);
+}
+
+/**
+* Relative moves use the controller's own relative move, so a z-stack with a
+* fixed spacing loads the distance once and then sends a single command per
+* step. Moves that would leave the travel range, and moves while
+* asynchronous moves are enabled, go through the absolute path instead.
+* The controller holds a single relative distance, so while "Trigger Move"
+* is "Relative" only the trigger step is moved relatively; any other
+* distance goes through the absolute path rather than replace it.
+*/
+int ThorlabsKinesisTCubeServo::SetRelativePositionUm(double dUm)
+{
+	if (connectionLost_)
+		return ERR_CONNECTION_LOST;
+	if (sequenceRunning_)
+		return ERR_SEQUENCE_RUNNING;
+	if (scanRunning_)
+		return ERR_SCAN_RUNNING;
+	if (homingRunning_)
+		return ERR_STAGE_NOT_ZEROED;
+
+	if (UsesMoveWorker())
+		return SetPositionUmFlag(curPosUm_ + dUm, 1);
+
+	int startCounts = GetStatus().position;
+	int targetCounts = startCounts + unitScale_.ToCounts(dUm);
+	double targetUm = unitScale_.ToUm(targetCounts);
+	if (!travelLimits_.Contains(targetCounts))
+		return SetPositionUmFlag(targetUm, 1);
+	if (mode_m == 0 && unitScale_.ToCounts(dUm) != unitScale_.ToCounts(moveRelStep_))
+		return SetPositionUmFlag(targetUm, 1);
+
+	int ret = LoadRelativeDistance(unitScale_.ToCounts(dUm));
+	if (ret != DEVICE_OK)
+		return ret;
+
+	StartMoveTracking(targetCounts);
+	timeline_.RecordCommand(KinesisTimeline::MoveRelative, unitScale_.ToCounts(dUm));
+	if (CC_MoveRelativeDistance(serialNumber_.c_str()) != 0)
+	{
+		moveTracker_.MoveAborted();
+		return ERR_MOVE_FAILED;
+	}
+	curPosUm_ = targetUm;
+	OnStagePositionChanged(curPosUm_);
+
+	KINESIS_LOG(KINESIS_LOG_DEBUG, "SetRelativePositionUm:%g", dUm);
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::SetOrigin()
+{
+	return DEVICE_UNSUPPORTED_COMMAND;
+}
+
+int ThorlabsKinesisTCubeServo::SetPositionSteps(long steps)
+{
+	steps = (long)0.1;
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::GetPositionSteps(long& steps)
+{
+	stepSizeUm_ = steps;
+	return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sequence API
+// The sequence is played back by a dedicated thread, which issues the next
+// move as soon as the move tracker sees the "moved" message for the previous
+// one. Like hardware-triggered sequences, it wraps around until stopped.
+///////////////////////////////////////////////////////////////////////////////
+
+int ThorlabsKinesisTCubeServo::GetStageSequenceMaxLength(long& nrEvents) const
+{
+	nrEvents = g_MaxSequenceLength;
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::ClearStageSequence()
+{
+	sequenceUm_.clear();
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::AddToStageSequence(double position)
+{
+	if ((long)sequenceUm_.size() >= g_MaxSequenceLength)
+		return DEVICE_SEQUENCE_TOO_LARGE;
+
+	sequenceUm_.push_back(position);
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::SendStageSequence()
+{
+	if (sequenceRunning_)
+		return ERR_SEQUENCE_RUNNING;
+
+	std::vector<double> positionsUm(sequenceUm_.size());
+	for (size_t i = 0; i < sequenceUm_.size(); i++)
+	{
+		int counts = unitScale_.ToCounts(sequenceUm_[i]);
+		int ret = ApplySoftLimitPolicy(counts);
+		if (ret != DEVICE_OK)
+			return ret;
+		positionsUm[i] = unitScale_.ToUm(counts);
+	}
+
+	KinesisMovePlanner planner;
+	{
+		std::lock_guard<std::mutex> guard(velocityProfileLock_);
+		planner.SetModels(moveTimeModel_, shortMoveTimeModel_, unitScale_.ToUm(shortMoveThresholdCounts_));
+	}
+	planner.SetApproachOvershootUm(approachFromBelow_ ? approachOvershootUm_ : 0.0);
+	sequencePlan_ = planner.Plan(positionsUm, unitScale_.ToUm(GetStatus().position), sequenceOrder_);
+
+	sequenceCounts_.clear();
+	sequenceCounts_.reserve(sequencePlan_.order.size());
+	for (size_t i = 0; i < sequencePlan_.order.size(); i++)
+		sequenceCounts_.push_back(unitScale_.ToCounts(positionsUm[sequencePlan_.order[i]]));
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "SendStageSequence: %u positions, %s, %g ms, %g um, %d reversals",
+		(unsigned)sequenceCounts_.size(), g_SequenceOrders[sequenceOrder_], sequencePlan_.totalMs,
+		sequencePlan_.travelUm, sequencePlan_.reversals);
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::StartStageSequence()
+{
+	if (connectionLost_)
+		return ERR_CONNECTION_LOST;
+	if (sequenceRunning_)
+		return ERR_SEQUENCE_RUNNING;
+	if (scanRunning_)
+		return ERR_SCAN_RUNNING;
+	if (homingRunning_)
+		return ERR_STAGE_NOT_ZEROED;
+	if (sequenceCounts_.empty())
+		return ERR_SEQUENCE_EMPTY;
+
+	if (sequenceThread_.joinable())
+		sequenceThread_.join();
+
+	sequenceRunning_ = true;
+	sequenceThread_ = std::thread(&ThorlabsKinesisTCubeServo::RunStageSequence, this);
+	return DEVICE_OK;
+}
+
+/**
+* Stops the stage where it is and ends the sequence.
+*/
+int ThorlabsKinesisTCubeServo::StopStageSequence()
+{
+	bool wasRunning = sequenceRunning_.exchange(false);
+	if (wasRunning)
+	{
+		timeline_.RecordCommand(KinesisTimeline::Stop);
+		CC_StopProfiled(serialNumber_.c_str());
+		// wakes the sequence thread up, the stopped message may not come
+		moveTracker_.MoveAborted();
+	}
+	if (sequenceThread_.joinable())
+		sequenceThread_.join();
+
+	return DEVICE_OK;
+}
+
+void ThorlabsKinesisTCubeServo::RunStageSequence()
+{
+	size_t i = 0;
+	while (sequenceRunning_)
+	{
+		StartMoveTracking(sequenceCounts_[i]);
+		if (ApproachCounts(sequenceCounts_[i]) != 0)
+		{
+			moveTracker_.MoveAborted();
+			KINESIS_LOG(KINESIS_LOG_ERROR, "Stage sequence stopped: move command rejected");
+			break;
+		}
+		// stopped while the command was being sent
+		if (!sequenceRunning_)
+		{
+			CC_StopProfiled(serialNumber_.c_str());
+			moveTracker_.MoveAborted();
+			break;
+		}
+
+		if (!moveTracker_.WaitForMoveComplete(g_MoveTimeoutMs))
+		{
+			KINESIS_LOG(KINESIS_LOG_ERROR, "Stage sequence stopped: move did not complete");
+			break;
+		}
+
+		i = (i + 1) % sequenceCounts_.size();
+	}
+
+	sequenceRunning_ = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Continuous scan
+// The stage is driven at constant velocity from the scan start to the scan
+// end while its position is sampled, so that camera frames can be tagged
+// with the interpolated position at their timestamp.
+///////////////////////////////////////////////////////////////////////////////
+
+int ThorlabsKinesisTCubeServo::StartScan()
+{
+	if (connectionLost_)
+		return ERR_CONNECTION_LOST;
+	if (scanRunning_)
+		return ERR_SCAN_RUNNING;
+	if (sequenceRunning_)
+		return ERR_SEQUENCE_RUNNING;
+	if (homingRunning_)
+		return ERR_STAGE_NOT_ZEROED;
+	if (scanStartUm_ == scanEndUm_ || GetScanVelocityUmPerS() <= 0.0 ||
+		scanStartUm_ < minTravelUm_ || scanStartUm_ > maxTravelUm_ ||
+		scanEndUm_ < minTravelUm_ || scanEndUm_ > maxTravelUm_)
+		return ERR_SCAN_INVALID;
+
+	if (scanThread_.joinable())
+		scanThread_.join();
+
+	{
+		std::lock_guard<std::mutex> guard(scanLock_);
+		scanSamples_.clear();
+	}
+	scanRunning_ = true;
+	scanThread_ = std::thread(&ThorlabsKinesisTCubeServo::RunScan, this);
+	return DEVICE_OK;
+}
+
+/**
+* Ends the scan early, the samples taken so far are kept.
+*/
+int ThorlabsKinesisTCubeServo::StopScan()
+{
+	scanRunning_ = false;
+	if (scanThread_.joinable())
+		scanThread_.join();
+
+	return DEVICE_OK;
+}
+
+void ThorlabsKinesisTCubeServo::GetScanSamples(std::vector<KinesisScanSample>& samples)
+{
+	std::lock_guard<std::mutex> guard(scanLock_);
+	samples = scanSamples_;
+}
+
+/**
+* Writes the position-vs-time samples of the last scan to path as CSV, one
+* row per sample, so frames can be matched to positions outside the adapter.
+*/
+bool ThorlabsKinesisTCubeServo::ExportScanSamples(const std::string& path)
+{
+	std::vector<KinesisScanSample> samples;
+	GetScanSamples(samples);
+
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "timestamp_us,position_um\n");
+	for (size_t i = 0; i < samples.size(); i++)
+		fprintf(file, "%lld,%.4f\n", samples[i].timestampUs, samples[i].positionUm);
+	bool written = ferror(file) == 0;
+	return fclose(file) == 0 && written;
+}
+
+/**
+* Interpolates the scan position at the given time. Returns false if the
+* time is outside of the sampled part of the scan.
+*/
+bool ThorlabsKinesisTCubeServo::GetScanPositionUm(long long timestampUs, double& posUm)
+{
+	std::lock_guard<std::mutex> guard(scanLock_);
+	if (scanSamples_.empty() || timestampUs < scanSamples_.front().timestampUs ||
+		timestampUs > scanSamples_.back().timestampUs)
+		return false;
+
+	size_t lo = 0, hi = scanSamples_.size() - 1;
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (scanSamples_[mid].timestampUs <= timestampUs)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	const KinesisScanSample& a = scanSamples_[lo];
+	const KinesisScanSample& b = scanSamples_[hi];
+	if (b.timestampUs == a.timestampUs)
+	{
+		posUm = a.positionUm;
+		return true;
+	}
+	double t = (double)(timestampUs - a.timestampUs) / (double)(b.timestampUs - a.timestampUs);
+	posUm = a.positionUm + t * (b.positionUm - a.positionUm);
+	return true;
+}
+
+/**
+* Moves up to maxSamples of the oldest sampler records into samples and
+* returns how many were moved. Not to be called from several threads.
+*/
+size_t ThorlabsKinesisTCubeServo::DrainPositionSamples(KinesisPositionSample* samples, size_t maxSamples)
+{
+	return positionSampler_.Drain(samples, maxSamples);
+}
+
+/**
+* The scan velocity, from the frame rate and the step per frame when a frame
+* rate is set, otherwise as set directly.
+*/
+double ThorlabsKinesisTCubeServo::GetScanVelocityUmPerS() const
+{
+	if (scanFrameRateHz_ > 0.0)
+		return scanFrameRateHz_ * scanStepUm_;
+	return scanVelocityUmPerS_;
+}
+
+void ThorlabsKinesisTCubeServo::RunScan()
+{
+	double startUm = scanStartUm_;
+	double endUm = scanEndUm_;
+	double velocityUmPerS = GetScanVelocityUmPerS();
+	bool forwards = endUm > startUm;
+
+	// run-up: position at the start with the regular profile
+	int startCounts = unitScale_.ToCounts(startUm);
+	StartMoveTracking(startCounts);
+	if (MoveToCounts(startCounts) != 0)
+	{
+		moveTracker_.MoveAborted();
+		KINESIS_LOG(KINESIS_LOG_ERROR, "Scan aborted: move to start rejected");
+		scanRunning_ = false;
+		return;
+	}
+	if (!moveTracker_.WaitForMoveComplete(g_MoveTimeoutMs) || !scanRunning_)
+	{
+		KINESIS_LOG(KINESIS_LOG_ERROR, "Scan aborted before the sweep");
+		scanRunning_ = false;
+		return;
+	}
+
+	MOT_VelocityParameters params;
+	{
+		std::lock_guard<std::mutex> guard(velocityProfileLock_);
+		params = defaultVelocity_;
+	}
+	params.maxVelocity = RealToDevice(velocityUmPerS / 1000, g_UnitVelocity);
+	if (velocityCache_.Apply(params) != 0)
+	{
+		KINESIS_LOG(KINESIS_LOG_ERROR, "Scan aborted: velocity rejected");
+		scanRunning_ = false;
+		return;
+	}
+
+	// stop early by the braking distance, so that the stage comes to rest at the end
+	double accelUmPerS2 = DeviceToReal(params.acceleration, g_UnitAcceleration) * 1000;
+	double brakingUm = accelUmPerS2 > 0.0 ? velocityUmPerS * velocityUmPerS / (2 * accelUmPerS2) : 0.0;
+	double stopUm = forwards ? endUm - brakingUm : endUm + brakingUm;
+
+	double sweepMs = std::fabs(endUm - startUm) / velocityUmPerS * 1000;
+	moveTracker_.MoveStarted(sweepMs);
+	timeline_.RecordCommand(KinesisTimeline::MoveAtVelocity, forwards ? 1 : -1);
+	if (CC_MoveAtVelocity(serialNumber_.c_str(), forwards ? MOT_Forwards : MOT_Backwards) != 0)
+	{
+		moveTracker_.MoveAborted();
+		KINESIS_LOG(KINESIS_LOG_ERROR, "Scan aborted: velocity move rejected");
+		scanRunning_ = false;
+		return;
+	}
+	KINESIS_LOG(KINESIS_LOG_INFO, "Scan %g -> %g um at %g um/s", startUm, endUm, velocityUmPerS);
+
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+		std::chrono::milliseconds((long long)(2 * sweepMs) + g_MoveTimeoutMs);
+	KinesisPositionWatch watch;
+	watch.Reset(serialNumber_);
+	KinesisPositionSample position;
+	while (scanRunning_ && std::chrono::steady_clock::now() < deadline)
+	{
+		if (!watch.Next(position, g_ScanSampleIntervalMs))
+			continue;
+		KinesisScanSample sample;
+		sample.positionUm = unitScale_.ToUm(position.counts);
+		sample.timestampUs = position.timestampUs;
+		{
+			std::lock_guard<std::mutex> guard(scanLock_);
+			if (scanSamples_.size() < g_MaxScanSamples)
+				scanSamples_.push_back(sample);
+		}
+
+		if (forwards ? sample.positionUm >= stopUm : sample.positionUm <= stopUm)
+			break;
+	}
+
+	timeline_.RecordCommand(KinesisTimeline::Stop);
+	CC_StopProfiled(serialNumber_.c_str());
+	moveTracker_.WaitForMoveComplete(g_MoveTimeoutMs);
+	scanRunning_ = false;
+	OnPropertyChanged(g_ScanProp, g_ScanIdle);
+}
+
+int ThorlabsKinesisTCubeServo::GetLimits(double& min, double& max)
+{
+
+	KINESIS_LOG(KINESIS_LOG_DEBUG, "In GetLimits(). chNumber:%ld pfMinPos:%g pfMaxPos:%g", chNumber_, pfMinPos, pfMaxPos);
+
+
+	min = minTravelUm_;
+	max = maxTravelUm_;
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::SetLimits(double min, double max)
+{
+	minTravelUm_ = min;
+	maxTravelUm_ = max;
+	if (initialized_)
+		return UpdateTravelLimits();
+	return DEVICE_OK;
+}
+
+/**
+* Converts the soft limits to device units, bounded by the stage range, and
+* hands them to the controller together with the soft limit policy. Moves
+* the controller runs on its own (triggers, jogs) are bounded there as well.
+*/
+int ThorlabsKinesisTCubeServo::SendTravelLimits()
+{
+	if (CC_SetStageAxisLimits(serialNumber_.c_str(), travelLimits_.minCounts, travelLimits_.maxCounts) != 0)
+		return ERR_LIMITS_FAILED;
+	CC_SetLimitsSoftwareApproachPolicy(serialNumber_.c_str(), (MOT_LimitsSoftwareApproachPolicy)softLimitPolicy_);
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::UpdateTravelLimits()
+{
+	travelLimits_.stageMinCounts = unitScale_.ToCounts(pfMinPos * 1000.0);
+	travelLimits_.stageMaxCounts = unitScale_.ToCounts(pfMaxPos * 1000.0);
+	travelLimits_.SetSoftLimits(unitScale_.ToCounts(minTravelUm_), unitScale_.ToCounts(maxTravelUm_));
+	minTravelUm_ = unitScale_.ToUm(travelLimits_.minCounts);
+	maxTravelUm_ = unitScale_.ToUm(travelLimits_.maxCounts);
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "Travel limits: %d..%d (stage %d..%d) policy:%d", travelLimits_.minCounts,
+		travelLimits_.maxCounts, travelLimits_.stageMinCounts, travelLimits_.stageMaxCounts, softLimitPolicy_);
+
+	int ret = SendTravelLimits();
+	if (ret != DEVICE_OK)
+		return ret;
+
+	if (initialized_)
+	{
+		SetPropertyLimits(g_Keyword_Position, minTravelUm_, maxTravelUm_);
+		SetPropertyLimits(g_TrigAbsPosProp, minTravelUm_, maxTravelUm_);
+	}
+	return DEVICE_OK;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// private methods
+///////////////////////////////////////////////////////////////////////////////
+
+void ThorlabsKinesisTCubeServo::init(std::string deviceName, long chNumber)
+{
+	long plNumUnits, plSerialNum;
+	int hola;
+	deviceName_ = deviceName;
+	chNumber_ = chNumber;
+	KinesisDeviceRegistry::Instance().AddClient();
+	InitializeDefaultErrorMessages();
+
+	// set device specific error messages
+	// ------------------------------------
+	SetErrorText(ERR_UNRECOGNIZED_ANSWER, "Invalid response from the device.");
+	SetErrorText(ERR_UNSPECIFIED_ERROR, "Unspecified error occured.");
+	SetErrorText(ERR_RESPONSE_TIMEOUT, "Device timed-out: no response received withing expected time interval.");
+	SetErrorText(ERR_BUSY, "Device busy.");
+	SetErrorText(ERR_MOVE_FAILED, "The controller rejected the move command.");
+	SetErrorText(ERR_SEQUENCE_EMPTY, "No stage sequence has been sent to the device.");
+	SetErrorText(ERR_SEQUENCE_RUNNING, "A stage sequence is running. Stop it first.");
+	SetErrorText(ERR_PID_FAILED, "The controller rejected the PID parameters.");
+	SetErrorText(ERR_AUTOTUNE_FAILED, "PID auto-tuning found no gains that settle within the settle timeout.");
+	SetErrorText(ERR_SCAN_RUNNING, "A continuous scan is running. Stop it first.");
+	SetErrorText(ERR_HOMING_FAILED, "The home sequence did not complete.");
+	SetErrorText(ERR_LIMITS_FAILED, "The controller rejected the travel limits.");
+	SetErrorText(ERR_CONNECTION_LOST, "The connection to the controller was lost. The adapter is reconnecting.");
+	SetErrorText(ERR_STEPS_OUT_OF_RANGE, "The target is beyond the soft limits and the \"Soft Limit Policy\" rejects such moves.");
+	SetErrorText(ERR_SCAN_INVALID, "The scan needs distinct start and end positions within the travel range, and a velocity.");
+	SetErrorText(ERR_STAGE_NOT_ZEROED, "Zero sequence still in progress.\n"
+		"Wait for few more seconds before trying again."
+		"Zero sequence executes only once per power cycle.");
+
+	// create pre-initialization properties
+	// ------------------------------------
+
+	// Name
+	CreateProperty(MM::g_Keyword_Name, deviceName.c_str(), MM::String, true);
+
+	// Description (will be properly updated later from MOT_GetStageAxisInfo)
+	CreateProperty(MM::g_Keyword_Description, "Thorlabs Stage", MM::String, true);
+
+	CPropertyAction* pAct = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnPosition);
+	CreateFloatProperty(g_Keyword_Position, 0, false, pAct);
+	SetPropertyLimits(g_Keyword_Position, minTravelUm_, maxTravelUm_);
+
+	// Serial Number
+	// The bus is enumerated once per process; cubes are only opened when a
+	// stage using them is initialized.
+	const std::vector<std::string>& serialNos = KinesisDeviceRegistry::Instance().SerialNumbers();
+	CPropertyAction* pAct1 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSerialNumber);
+	CreateProperty(g_SerialNumberProp, serialNos.empty() ? "" : serialNos[0].c_str(), MM::String, false, pAct1, true);
+	for (size_t i = 0; i < serialNos.size(); i++)
+	{
+		AddAllowedValue(g_SerialNumberProp, serialNos[i].c_str());
+	}
+	if (!serialNos.empty())
+		serialNumber_ = serialNos[0];
+
+	// Stage profile: resolution used to convert um to device units
+	CPropertyAction* pAct5 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnStageProfile);
+	CreateProperty(g_StageProfileProp, g_StageProfileAuto, MM::String, false, pAct5, true);
+	AddAllowedValue(g_StageProfileProp, g_StageProfileAuto);
+	for (int i = 0; i < g_NumStageProfiles; i++)
+	{
+		AddAllowedValue(g_StageProfileProp, g_StageProfiles[i].name);
+	}
+
+	// Homing done by Initialize: none, before it returns, or in the background
+	CPropertyAction* pAct7 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnHomeOnInitialize);
+	CreateProperty(g_HomeOnInitializeProp, g_No, MM::String, false, pAct7, true);
+	AddAllowedValue(g_HomeOnInitializeProp, g_No);
+	AddAllowedValue(g_HomeOnInitializeProp, g_HomeBlocking);
+	AddAllowedValue(g_HomeOnInitializeProp, g_HomeBackground);
+
+	// Stage sequences step through their positions without waiting for the
+	// camera, so hardware-sequenced acquisitions must opt in
+	CPropertyAction* pAct8 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnSequenceable);
+	CreateProperty(g_SequenceableProp, g_No, MM::String, false, pAct8, true);
+	AddAllowedValue(g_SequenceableProp, g_No);
+	AddAllowedValue(g_SequenceableProp, g_Yes);
+
+	//Populating the Channel drop-down menu (last one selected by default?)
+	CPropertyAction* pAct2 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnChannelNumber);
+	CreateProperty(g_ChannelProp, "1", MM::Integer, false, pAct2, true);
+
+	for (int i = 0; i < chNumber_; i++)
+	{
+		AddAllowedValue(g_ChannelProp, CDeviceUtils::ConvertToString(i + 1));
+	}
+	chNumber_ = 1;
+
+	//Populating the min and max values for min travel
+
+	//At this point in time, we do not know the real min and max travel.
+	//These depend on the serial number and channel and type of stage attached.
+	//Widely, 0-500000 um should cover the rotation stages as well (0-360*1000?)
+	//GetLimits(minTravelUm_, maxTravelUm_);
+	pfMinPos = (float)(minTravelUm_ / 1000);
+	pfMaxPos = (float)(maxTravelUm_ / 1000);
+
+	CPropertyAction* pAct3 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMinPosUm);
+	CreateProperty(g_MinPosProp, CDeviceUtils::ConvertToString(minTravelUm_), MM::Float, false, pAct3, true);
+	CreateProperty(g_MinPosProp, CDeviceUtils::ConvertToString(minTravelUm_), MM::Float, false, pAct3);
+	//SetPropertyLimits(g_MinPosProp, minTravelUm_, maxTravelUm_);
+
+	CPropertyAction* pAct4 = new CPropertyAction(this, &ThorlabsKinesisTCubeServo::OnMaxPosUm);
+	CreateProperty(g_MaxPosProp, CDeviceUtils::ConvertToString(maxTravelUm_), MM::Float, false, pAct4, true);
+	CreateProperty(g_MaxPosProp, CDeviceUtils::ConvertToString(maxTravelUm_), MM::Float, false, pAct4);
+	//SetPropertyLimits(g_MaxPosProp, minTravelUm_, maxTravelUm_);
+}
+
+/**
+* Log messages are formatted into the fixed-size ring buffer on the calling
+* thread and passed on to LogMessage() by this background thread, so logging
+* costs no allocation or core call on the move and position read paths.
+*/
+void ThorlabsKinesisTCubeServo::StartLogFlusher()
+{
+	if (logFlusher_.joinable())
+		return;
+
+	logFlusherRunning_ = true;
+	logFlusher_ = std::thread(&ThorlabsKinesisTCubeServo::RunLogFlusher, this);
+}
+
+void ThorlabsKinesisTCubeServo::StopLogFlusher()
+{
+	{
+		std::lock_guard<std::mutex> guard(logFlusherLock_);
+		logFlusherRunning_ = false;
+	}
+	logFlusherCond_.notify_one();
+	if (logFlusher_.joinable())
+		logFlusher_.join();
+
+	FlushLog();
+}
+
+void ThorlabsKinesisTCubeServo::RunLogFlusher()
+{
+	std::unique_lock<std::mutex> lk(logFlusherLock_);
+	while (logFlusherRunning_)
+	{
+		logFlusherCond_.wait_for(lk, std::chrono::milliseconds(g_LogFlushIntervalMs));
+		lk.unlock();
+		FlushLog();
+		lk.lock();
+	}
+}
+
+void ThorlabsKinesisTCubeServo::FlushLog()
+{
+	char text[KinesisLogRing::SlotSize];
+	while (logRing_.Pop(text, sizeof(text)))
+	{
+		std::string message = deviceName_ + "-" + serialNumber_ + " " + text;
+		LogMessage(message.c_str());
+	}
+
+	unsigned dropped = logRing_.TakeDropped();
+	if (dropped > 0)
+	{
+		std::ostringstream os;
+		os << deviceName_ << "-" << serialNumber_ << " " << dropped << " log messages dropped";
+		LogMessage(os.str().c_str());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Connection watchdog
+// The Kinesis last-message timer overruns when the cube sent nothing for the
+// watchdog timeout. While polling runs a healthy cube answers every polling
+// period, so the watchdog checks the timer at that rate. A lost connection
+// makes moves and position reads fail with ERR_CONNECTION_LOST instead of
+// working from stale values, while the watchdog reopens the cube.
+///////////////////////////////////////////////////////////////////////////////
+
+void ThorlabsKinesisTCubeServo::StartWatchdog()
+{
+	if (watchdog_.joinable())
+		return;
+
+	if (watchdogTimeoutMs_ > 0)
+		CC_EnableLastMsgTimer(serialNumber_.c_str(), true, watchdogTimeoutMs_);
+	watchdogRunning_ = true;
+	watchdog_ = std::thread(&ThorlabsKinesisTCubeServo::RunWatchdog, this);
+}
+
+void ThorlabsKinesisTCubeServo::StopWatchdog()
+{
+	{
+		std::lock_guard<std::mutex> guard(watchdogLock_);
+		watchdogRunning_ = false;
+	}
+	watchdogCond_.notify_one();
+	if (watchdog_.joinable())
+		watchdog_.join();
+	CC_EnableLastMsgTimer(serialNumber_.c_str(), false, 0);
+}
+
+void ThorlabsKinesisTCubeServo::RunWatchdog()
+{
+	std::chrono::steady_clock::time_point lastAttempt;
+	std::unique_lock<std::mutex> lk(watchdogLock_);
+	while (watchdogRunning_)
+	{
+		watchdogCond_.wait_for(lk, std::chrono::milliseconds(g_PollingIntervalMs));
+		if (!watchdogRunning_ || watchdogTimeoutMs_ <= 0)
+			continue;
+		lk.unlock();
+
+		if (!connectionLost_ && CC_HasLastMsgTimerOverrun(serialNumber_.c_str()))
+		{
+			connectionLost_ = true;
+			movePending_ = false;
+			moveTracker_.MoveAborted();
+			KINESIS_LOG(KINESIS_LOG_ERROR, "No message from the controller for %ld ms, connection lost", watchdogTimeoutMs_);
+			OnPropertyChanged(g_ConnectionProp, g_ConnectionLost);
+		}
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (connectionLost_ && now - lastAttempt >= std::chrono::milliseconds(g_ReconnectIntervalMs))
+		{
+			lastAttempt = now;
+			if (Reconnect())
+			{
+				connectionLost_ = false;
+				reconnects_++;
+				KINESIS_LOG(KINESIS_LOG_INFO, "Reconnected");
+				OnPropertyChanged(g_ConnectionProp, g_ConnectionOk);
+			}
+		}
+
+		lk.lock();
+	}
+}
+
+/**
+* Reopens the cube and restores what the adapter keeps on the controller:
+* the settings, the travel limits and the velocity profile.
+*/
+bool ThorlabsKinesisTCubeServo::Reconnect()
+{
+	if (!CC_CheckConnection(serialNumber_.c_str()))
+		return false;
+	if (!KinesisDeviceRegistry::Instance().Reconnect(serialNumber_))
+		return false;
+
+	moveTracker_.Reconnected();
+	CC_EnableLastMsgTimer(serialNumber_.c_str(), true, watchdogTimeoutMs_);
+	statusCache_.RequestAndRefresh();
+	SendTravelLimits();
+	relDistanceValid_ = false;
+	ApplyTriggerMove();
+	MOT_VelocityParameters params;
+	{
+		std::lock_guard<std::mutex> guard(velocityProfileLock_);
+		params = defaultVelocity_;
+	}
+	velocityCache_.Load();
+	velocityCache_.Apply(params);
+	return true;
+}
+
+/**
+* Applies the "Soft Limit Policy" to a target on the host, as the controller
+* would: rejected, truncated to the soft limits, or passed on unchanged.
+*/
+int ThorlabsKinesisTCubeServo::ApplySoftLimitPolicy(int& counts) const
+{
+	if (travelLimits_.Contains(counts))
+		return DEVICE_OK;
+
+	switch (softLimitPolicy_)
+	{
+	case DisallowIllegalMoves:
+		return ERR_STEPS_OUT_OF_RANGE;
+	case AllowPartialMoves:
+		counts = travelLimits_.Clamp(counts);
+		break;
+	default:
+		break;
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::SetPositionUmFlag(double posUm, int continuousFlag)
+{
+	if (connectionLost_)
+		return ERR_CONNECTION_LOST;
+	if (sequenceRunning_)
+		return ERR_SEQUENCE_RUNNING;
+	if (scanRunning_)
+		return ERR_SCAN_RUNNING;
+	if (homingRunning_)
+		return ERR_STAGE_NOT_ZEROED;
+
+	int targetCounts = unitScale_.ToCounts(posUm);
+	int ret = ApplySoftLimitPolicy(targetCounts);
+	if (ret != DEVICE_OK)
+		return ret;
+	curPosUm_ = unitScale_.ToUm(targetCounts);
+	if (UsesMoveWorker())
+	{
+		QueueMove(targetCounts);
+	}
+	else
+	{
+		StartMoveTracking(targetCounts);
+		if (MoveToCounts(targetCounts) != 0)
+		{
+			moveTracker_.MoveAborted();
+			return ERR_MOVE_FAILED;
+		}
+	}
+	OnStagePositionChanged(curPosUm_);
+
+	KINESIS_LOG(KINESIS_LOG_DEBUG, "SetPositionUm:%g continuousFlag:%d", posUm, continuousFlag);
+
+	return DEVICE_OK;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous moves
+// With "Asynchronous Moves" enabled, absolute moves are handed to a worker
+// thread. A target that arrives while a move is in flight replaces the one
+// still waiting ("latest wins"), so a burst of targets from the focus knob or
+// a script results in at most one queued move.
+///////////////////////////////////////////////////////////////////////////////
+
+void ThorlabsKinesisTCubeServo::QueueMove(int targetCounts)
+{
+	{
+		std::lock_guard<std::mutex> guard(moveQueueLock_);
+		pendingTarget_ = targetCounts;
+		movePending_ = true;
+	}
+	moveQueueCond_.notify_one();
+}
+
+void ThorlabsKinesisTCubeServo::StopMoveWorker()
+{
+	{
+		std::lock_guard<std::mutex> guard(moveQueueLock_);
+		moveWorkerRunning_ = false;
+	}
+	moveQueueCond_.notify_one();
+	if (moveWorker_.joinable())
+		moveWorker_.join();
+	movePending_ = false;
+}
+
+void ThorlabsKinesisTCubeServo::RunMoveWorker()
+{
+	while (true)
+	{
+		int target;
+		{
+			std::unique_lock<std::mutex> lk(moveQueueLock_);
+			moveQueueCond_.wait(lk, [this] { return movePending_ || !moveWorkerRunning_; });
+			if (!moveWorkerRunning_)
+				break;
+
+			// raise the moving flag before dropping the pending one, so Busy()
+			// never sees the stage idle in between
+			target = pendingTarget_;
+			StartMoveTracking(target);
+			movePending_ = false;
+		}
+
+		if ((jogMode_ ? JogToCounts(target) : ApproachCounts(target)) != 0)
+		{
+			moveTracker_.MoveAborted();
+			KINESIS_LOG(KINESIS_LOG_ERROR, "Asynchronous move rejected by the controller");
+			continue;
+		}
+
+		if (!moveTracker_.WaitForMoveComplete(g_MoveTimeoutMs))
+			KINESIS_LOG(KINESIS_LOG_ERROR, "Asynchronous move did not complete in time");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Jog mode
+// Manual focusing sends a stream of small moves. In jog mode these go
+// through the move worker like asynchronous moves, so steps arriving while
+// a jog is in flight add up to a single target, and are then sent as one
+// CC_MoveJog. The jog parameters are preloaded with the jog step, which
+// makes a regular single step one command with no parameter traffic; any
+// other distance is a single absolute move.
+///////////////////////////////////////////////////////////////////////////////
+
+int ThorlabsKinesisTCubeServo::LoadJogParams()
+{
+	MOT_JogParameters params;
+	if (CC_GetJogParamsBlock(serialNumber_.c_str(), &params) != 0)
+		return ERR_MOVE_FAILED;
+
+	params.mode = MOT_SingleStep;
+	params.stopMode = MOT_Profiled;
+	int stepCounts = unitScale_.ToCounts(jogStepUm_);
+	params.stepSize = (unsigned int)(stepCounts > 0 ? stepCounts : 1);
+	params.velParams.minVelocity = 0;
+	params.velParams.maxVelocity = RealToDevice(jogVelocityMmPerS_, g_UnitVelocity);
+	{
+		std::lock_guard<std::mutex> guard(velocityProfileLock_);
+		params.velParams.acceleration = defaultVelocity_.acceleration;
+	}
+	if (CC_SetJogParamsBlock(serialNumber_.c_str(), &params) != 0)
+		return ERR_MOVE_FAILED;
+
+	jogStepCounts_ = (int)params.stepSize;
+	return DEVICE_OK;
+}
+
+/**
+* Jogs to targetCounts if it is exactly one preloaded jog step away from the
+* current position, and moves there absolutely otherwise. Called from the
+* move worker once the previous move is over.
+*/
+short ThorlabsKinesisTCubeServo::JogToCounts(int targetCounts)
+{
+	int distance = targetCounts - GetStatus().position;
+	if (distance == 0)
+	{
+		moveTracker_.MoveAborted();
+		return 0;
+	}
+	if (std::abs(distance) != jogStepCounts_)
+		return MoveToCounts(targetCounts);
+
+	long long startUs = KinesisStatusCache::NowUs();
+	timeline_.RecordCommand(KinesisTimeline::MoveJog, distance > 0 ? (int)jogStepCounts_ : -(int)jogStepCounts_);
+	short ret = CC_MoveJog(serialNumber_.c_str(), distance > 0 ? MOT_Forwards : MOT_Backwards);
+	latencyStats_.metrics[KinesisLatencyStats::MoveCommand].Record(KinesisStatusCache::NowUs() - startUs);
+	return ret;
+}
+
+/**
+* Homes the stage, unless the controller already reports it as homed.
+* Blocks until the home sequence completes.
+*/
+int ThorlabsKinesisTCubeServo::Home()
+{
+	if (homingRunning_)
+		return ERR_STAGE_NOT_ZEROED;
+
+	homed_ = IsHomed();
+	if (homed_)
+	{
+		KINESIS_LOG(KINESIS_LOG_INFO, "Home skipped, already homed");
+		homingProgress_ = 100;
+		return DEVICE_OK;
+	}
+
+	return ForceHome();
+}
+
+/**
+* Runs the home sequence even if the stage is already homed.
+*/
+int ThorlabsKinesisTCubeServo::ForceHome()
+{
+	if (homingRunning_)
+		return ERR_STAGE_NOT_ZEROED;
+	if (sequenceRunning_)
+		return ERR_SEQUENCE_RUNNING;
+	if (scanRunning_)
+		return ERR_SCAN_RUNNING;
+
+	homingRunning_ = true;
+	int ret = RunHoming();
+	homingRunning_ = false;
+	return ret;
+}
+
+/**
+* Controller's homed bit, from a status no older than "Max Status Age (ms)".
+*/
+bool ThorlabsKinesisTCubeServo::IsHomed()
+{
+	return (GetStatus().statusBits & KINESIS_STATUS_HOMED) != 0;
+}
+
+/**
+* Sends the home command and waits for the homed bit, updating the homing
+* progress on the way. Called with homingRunning_ set.
+*/
+int ThorlabsKinesisTCubeServo::RunHoming()
+{
+	homed_ = false;
+	homingProgress_ = 0;
+	homingStartCounts_ = statusCache_.Read().position;
+	relDistanceValid_ = false;
+
+	moveTracker_.MoveStarted();
+	timeline_.RecordCommand(KinesisTimeline::Home);
+	if (CC_Home(serialNumber_.c_str()) != 0)
+	{
+		moveTracker_.MoveAborted();
+		KINESIS_LOG(KINESIS_LOG_ERROR, "CC_Home rejected");
+		return ERR_MOVE_FAILED;
+	}
+	KINESIS_LOG(KINESIS_LOG_INFO, "Homing from %d", homingStartCounts_);
+
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(g_HomeTimeoutMs);
+	while (homingRunning_ && std::chrono::steady_clock::now() < deadline)
+	{
+		// the homed message ends the wait, the bit may follow a poll later
+		if (moveTracker_.WaitForMoveComplete(g_PollingIntervalMs))
+			std::this_thread::sleep_for(std::chrono::milliseconds(g_ScanSampleIntervalMs));
+		KinesisStatusSnapshot status = GetStatus();
+		UpdateHomingProgress(status);
+		if ((status.statusBits & KINESIS_STATUS_HOMED) && !(status.statusBits & KINESIS_STATUS_HOMING))
+		{
+			homed_ = true;
+			homingProgress_ = 100;
+			break;
+		}
+	}
+
+	if (!homed_)
+	{
+		KINESIS_LOG(KINESIS_LOG_ERROR, "Home sequence did not complete");
+		return ERR_HOMING_FAILED;
+	}
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "Homed");
+	curPosUm_ = unitScale_.ToUm(statusCache_.Read().position);
+	OnStagePositionChanged(curPosUm_);
+	return DEVICE_OK;
+}
+
+/**
+* The home sequence runs towards the home switch and settles at zero, so
+* progress is the fraction of the starting distance to zero covered so far.
+*/
+void ThorlabsKinesisTCubeServo::UpdateHomingProgress(const KinesisStatusSnapshot& status)
+{
+	if (homingStartCounts_ == 0)
+		return;
+
+	double remaining = (double)status.position / homingStartCounts_;
+	long progress = (long)(100 * (1.0 - remaining));
+	if (progress < 0)
+		progress = 0;
+	if (progress > 99)
+		progress = 99;
+	if (progress > homingProgress_)
+		homingProgress_ = progress;
+}
+
+void ThorlabsKinesisTCubeServo::StartBackgroundHoming()
+{
+	StopBackgroundHoming();
+	homingRunning_ = true;
+	homingThread_ = std::thread([this]() {
+		RunHoming();
+		homingRunning_ = false;
+	});
+}
+
+/**
+* Stops waiting for a background home; the controller finishes the sequence.
+*/
+void ThorlabsKinesisTCubeServo::StopBackgroundHoming()
+{
+	homingRunning_ = false;
+	if (homingThread_.joinable())
+		homingThread_.join();
+}
+
+/**
+* Reports the velocity of the default profile, in mm/s.
+*/
+int ThorlabsKinesisTCubeServo::GetVelParam(double& vel)
+{
+	int maxVelocity;
+	{
+		std::lock_guard<std::mutex> guard(velocityProfileLock_);
+		maxVelocity = defaultVelocity_.maxVelocity;
+	}
+	vel = DeviceToReal(maxVelocity, g_UnitVelocity);
+
+	return DEVICE_OK;
+}
+
+/**
+* Sets the velocity of the default profile, in mm/s, and sends it right
+* away unless short moves use their own profile.
+*/
+int ThorlabsKinesisTCubeServo::SetVelParam(double vel)
+{
+	if (vel > pfMaxVel)
+		vel = pfMaxVel;
+
+	MOT_VelocityParameters params;
+	bool applyNow;
+	{
+		std::lock_guard<std::mutex> guard(velocityProfileLock_);
+		defaultVelocity_.maxVelocity = RealToDevice(vel, g_UnitVelocity);
+		params = defaultVelocity_;
+		applyNow = (shortMoveThresholdCounts_ == 0);
+	}
+	UpdateMoveTimeModel();
+
+	if (applyNow && velocityCache_.Apply(params) != 0)
+		return ERR_MOVE_FAILED;
+
+	return DEVICE_OK;
+}
+
+/**
+* Sets up the um <-> device unit conversion for the selected stage profile.
+* With the automatic profile, the scale is taken from the settings Kinesis
+* loaded for the stage.
+*/
+int ThorlabsKinesisTCubeServo::ResolveUnitScale()
+{
+	if (stageProfile_ == g_StageProfileAuto && settingsValid_ && settings_.countsPerMm > 0.0)
+	{
+		unitScale_.SetCountsPerMm(settings_.countsPerMm);
+	}
+	else
+	{
+		int ret = ResolveKinesisUnitScale(serialNumber_, stageProfile_, unitScale_);
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "Device units per mm: %g", unitScale_.CountsPerMm());
+
+	return DEVICE_OK;
+}
+
+/**
+* Returns the cached device state, taken over from the DLL's local copy and,
+* only if that is still older than the "Max Status Age (ms)" property, asked
+* from the controller.
+*/
+KinesisStatusSnapshot ThorlabsKinesisTCubeServo::GetStatus()
+{
+	statusCache_.Refresh();
+	if (statusCache_.AgeMs() > maxStatusAgeMs_)
+		statusCache_.RequestAndRefresh();
+
+	return statusCache_.Read();
+}
+
+/**
+* Values served to BeforeGet handlers. Renewed from a single status read
+* when older than one refresh period, so that refreshing all properties
+* touches the DLL once.
+*/
+const KinesisPropertySnapshot& ThorlabsKinesisTCubeServo::GetPropertySnapshot(bool force)
+{
+	long long nowUs = KinesisStatusCache::NowUs();
+	if (!force && propertyRefreshHz_ > 0.0 &&
+		nowUs - propertySnapshot_.timestampUs < (long long)(1e6 / propertyRefreshHz_))
+		return propertySnapshot_;
+
+	KinesisStatusSnapshot status = GetStatus();
+	propertySnapshot_.positionUm = unitScale_.ToUm(status.position);
+	propertySnapshot_.statusBits = status.statusBits;
+	GetVelParam(propertySnapshot_.velocityMmPerS);
+	propertySnapshot_.timestampUs = nowUs;
+
+	KINESIS_LOG(KINESIS_LOG_DEBUG, "Property snapshot: pos:%g vel:%g status:0x%08x", propertySnapshot_.positionUm,
+		propertySnapshot_.velocityMmPerS, (unsigned)propertySnapshot_.statusBits);
+	return propertySnapshot_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int ThorlabsKinesisTCubeServo::OnSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(serialNumber_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		if (initialized_)
+		{
+			string serialNumber;
+			pProp->Get(serialNumber);
+			serialNumber_ = serialNumber;
+
+		}
+
+		string previousSerialNumber = serialNumber_;
+		string serialNumber;
+		pProp->Get(serialNumber);
+		serialNumber_ = serialNumber;
+
+		// start opening the cube now, so that all cubes of a configuration
+		// get opened concurrently before they are initialized one by one
+		if (!initialized_)
+		{
+			if (serialNumber != previousSerialNumber)
+				KinesisDeviceRegistry::Instance().CancelPrefetch(previousSerialNumber);
+			KinesisDeviceRegistry::Instance().Prefetch(serialNumber_);
+		}
+	}
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "Serial number set to %s", serialNumber_.c_str());
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnChannelNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(chNumber_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		if (initialized_)
+		{
+			long chNumber;
+			pProp->Get(chNumber);
+			chNumber_ = chNumber;
+
+		}
+
+		pProp->Get(chNumber_);
+	}
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "Channel number set to %ld", chNumber_);
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnMinPosUm(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(minTravelUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(minTravelUm_);
+		if (initialized_)
+		{
+			int ret = UpdateTravelLimits();
+			pProp->Set(minTravelUm_);
+			if (ret != DEVICE_OK)
+				return ret;
+		}
+
+		KINESIS_LOG(KINESIS_LOG_DEBUG, "minTravelUm_ set to %g pfMinPos:%g pfMaxPos:%g", minTravelUm_, pfMinPos, pfMaxPos);
+	}
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnMaxPosUm(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(maxTravelUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(maxTravelUm_);
+		if (initialized_)
+		{
+			int ret = UpdateTravelLimits();
+			pProp->Set(maxTravelUm_);
+			if (ret != DEVICE_OK)
+				return ret;
+		}
+
+		KINESIS_LOG(KINESIS_LOG_DEBUG, "maxTravelUm_ set to %g pfMinPos:%g pfMaxPos:%g", maxTravelUm_, pfMinPos, pfMaxPos);
+	}
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnConnection(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(connectionLost_ ? g_ConnectionLost : g_ConnectionOk);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnWatchdogTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(watchdogTimeoutMs_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long timeoutMs;
+		pProp->Get(timeoutMs);
+		{
+			std::lock_guard<std::mutex> guard(watchdogLock_);
+			watchdogTimeoutMs_ = timeoutMs;
+		}
+		CC_EnableLastMsgTimer(serialNumber_.c_str(), timeoutMs > 0, timeoutMs);
+		if (timeoutMs <= 0)
+			connectionLost_ = false;
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnReconnects(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(reconnects_.load());
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSoftLimitPolicy(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_SoftLimitPolicies[softLimitPolicy_]);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		for (int i = 0; i < g_NumSoftLimitPolicies; i++)
+		{
+			if (value == g_SoftLimitPolicies[i])
+				softLimitPolicy_ = i;
+		}
+		CC_SetLimitsSoftwareApproachPolicy(serialNumber_.c_str(), (MOT_LimitsSoftwareApproachPolicy)softLimitPolicy_);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnPosition(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(GetPropertySnapshot().positionUm);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double pos = 0.0;
+		pProp->Get(pos);
+		int ret = SetPositionUm(pos);
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+
+	return DEVICE_OK;
+}
+
+
+int ThorlabsKinesisTCubeServo::OnVelocity(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(GetPropertySnapshot().velocityMmPerS);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double vel;
+		pProp->Get(vel);
+		int ret = SetVelParam(vel);
+		if (ret != DEVICE_OK)
+			return ret;
+		GetVelParam(propertySnapshot_.velocityMmPerS);
+	}
+
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnVelocityProfile(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	int unitType = (index == ProfileShortVelocity) ? g_UnitVelocity : g_UnitAcceleration;
+	if (eAct == MM::BeforeGet)
+	{
+		int deviceUnits;
+		{
+			std::lock_guard<std::mutex> guard(velocityProfileLock_);
+			if (index == ProfileDefaultAcceleration)
+				deviceUnits = defaultVelocity_.acceleration;
+			else if (index == ProfileShortVelocity)
+				deviceUnits = shortMoveVelocity_.maxVelocity;
+			else
+				deviceUnits = shortMoveVelocity_.acceleration;
+		}
+		pProp->Set(DeviceToReal(deviceUnits, unitType));
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double value;
+		pProp->Get(value);
+		int deviceUnits = RealToDevice(value, unitType);
+		{
+			std::lock_guard<std::mutex> guard(velocityProfileLock_);
+			if (index == ProfileDefaultAcceleration)
+				defaultVelocity_.acceleration = deviceUnits;
+			else if (index == ProfileShortVelocity)
+				shortMoveVelocity_.maxVelocity = deviceUnits;
+			else
+				shortMoveVelocity_.acceleration = deviceUnits;
+		}
+		UpdateMoveTimeModel();
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnShortMoveThreshold(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	std::lock_guard<std::mutex> guard(velocityProfileLock_);
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(unitScale_.ToUm(shortMoveThresholdCounts_));
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double thresholdUm;
+		pProp->Get(thresholdUm);
+		shortMoveThresholdCounts_ = unitScale_.ToCounts(thresholdUm);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnScan(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scanRunning_ ? g_ScanRunning : g_ScanIdle);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		int ret = (value == g_ScanRunning) ? StartScan() : StopScan();
+		if (ret != DEVICE_OK)
+		{
+			pProp->Set(g_ScanIdle);
+			return ret;
+		}
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnScanParam(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	double* params[] = { &scanStartUm_, &scanEndUm_, &scanVelocityUmPerS_, &scanFrameRateHz_, &scanStepUm_ };
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(*params[index]);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		if (scanRunning_)
+		{
+			pProp->Set(*params[index]);
+			return ERR_SCAN_RUNNING;
+		}
+		pProp->Get(*params[index]);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnScanSampleCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		std::lock_guard<std::mutex> guard(scanLock_);
+		pProp->Set((long)scanSamples_.size());
+	}
+	return DEVICE_OK;
+}
+
+/**
+* Setting a file name writes the samples of the last scan to it. The
+* timestamps are on the same clock as the motion timeline.
+*/
+int ThorlabsKinesisTCubeServo::OnScanExport(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scanExport_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string path;
+		pProp->Get(path);
+		if (path.empty())
+			return DEVICE_OK;
+		if (!ExportScanSamples(path))
+		{
+			KINESIS_LOG(KINESIS_LOG_ERROR, "Cannot write the scan samples to %s", path.c_str());
+			pProp->Set(scanExport_.c_str());
+			return DEVICE_CAN_NOT_SET_PROPERTY;
+		}
+		scanExport_ = path;
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnJogMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(jogMode_ ? g_Yes : g_No);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		bool enable = (value == g_Yes);
+		if (enable && !jogMode_)
+		{
+			int ret = LoadJogParams();
+			if (ret != DEVICE_OK)
+			{
+				pProp->Set(g_No);
+				return ret;
+			}
+		}
+		jogMode_ = enable;
+	}
+	return DEVICE_OK;
+}
+
+/**
+* Backlash distance the controller adds to moves in the reverse direction.
+*/
+int ThorlabsKinesisTCubeServo::OnBacklash(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(unitScale_.ToUm(backlashCounts_));
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double backlashUm;
+		pProp->Get(backlashUm);
+		int counts = unitScale_.ToCounts(backlashUm);
+		if (CC_SetBacklash(serialNumber_.c_str(), counts) != 0)
+		{
+			pProp->Set(unitScale_.ToUm(backlashCounts_));
+			return ERR_MOVE_FAILED;
+		}
+		backlashCounts_ = counts;
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnApproachMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(approachFromBelow_ ? g_ApproachFromBelow : g_ApproachDirect);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		approachFromBelow_ = (value == g_ApproachFromBelow);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnApproachOvershoot(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(approachOvershootUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(approachOvershootUm_);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnJogStep(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(jogStepUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(jogStepUm_);
+		if (jogMode_)
+			return LoadJogParams();
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnJogVelocity(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(jogVelocityMmPerS_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(jogVelocityMmPerS_);
+		if (jogMode_)
+			return LoadJogParams();
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSampler(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(positionSampler_.IsRunning() ? g_Yes : g_No);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		if (value == g_Yes)
+		{
+			if (!positionSampler_.Start(serialNumber_, samplerIntervalMs_, samplerFile_))
+			{
+				pProp->Set(g_No);
+				return DEVICE_CAN_NOT_SET_PROPERTY;
+			}
+		}
+		else
+		{
+			positionSampler_.Stop();
+		}
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSamplerInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(samplerIntervalMs_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(samplerIntervalMs_);
+	}
+	return DEVICE_OK;
+}
+
+/**
+* Takes effect the next time the sampler is started.
+*/
+int ThorlabsKinesisTCubeServo::OnSamplerFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(samplerFile_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(samplerFile_);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSamplerPending(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)positionSampler_.Pending());
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSamplerDropped(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)positionSampler_.Dropped());
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnTimeline(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(timeline_.IsEnabled() ? g_Yes : g_No);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		timeline_.SetEnabled(value == g_Yes);
+	}
+	return DEVICE_OK;
+}
+
+/**
+* Setting a file name writes the events recorded since the last export to it.
+*/
+int ThorlabsKinesisTCubeServo::OnTimelineExport(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(timelineExport_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string path;
+		pProp->Get(path);
+		if (path.empty())
+			return DEVICE_OK;
+		if (!timeline_.Export(path))
+		{
+			KINESIS_LOG(KINESIS_LOG_ERROR, "Cannot write the motion timeline to %s", path.c_str());
+			pProp->Set(timelineExport_.c_str());
+			return DEVICE_CAN_NOT_SET_PROPERTY;
+		}
+		timelineExport_ = path;
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnTimelineEvents(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)timeline_.Size());
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnTimelineDropped(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)timeline_.Dropped());
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnHome(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)homed_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long home;
+		pProp->Get(home);
+
+		int ret = DEVICE_OK;
+		if (home == 1)
+			ret = Home();
+		else if (home == 2)
+			ret = ForceHome();
+		pProp->Set((long)homed_);
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnHomeOnInitialize(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(homeOnInitialize_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(homeOnInitialize_);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(sequenceable_ ? g_Yes : g_No);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		sequenceable_ = (value == g_Yes);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnHomingState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		if (homingRunning_)
+			pProp->Set(g_HomingInProgress);
+		else
+		{
+			DWORD status = GetPropertySnapshot().statusBits;
+			homed_ = (status & KINESIS_STATUS_HOMED) != 0;
+			if (status & KINESIS_STATUS_HOMING)
+				pProp->Set(g_HomingInProgress);
+			else if (homed_)
+				pProp->Set(g_HomingHomed);
+			else
+				pProp->Set(needsHoming_ ? g_HomingNotHomed : g_HomingNotRequired);
+		}
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnHomingProgress(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(homingProgress_.load());
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnAsyncMoves(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(asyncMoves_ ? g_Yes : g_No);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string val;
+		pProp->Get(val);
+		asyncMoves_ = (val == g_Yes);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSettleTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(moveTimeModel_.settleMs);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::lock_guard<std::mutex> guard(velocityProfileLock_);
+		pProp->Get(moveTimeModel_.settleMs);
+		shortMoveTimeModel_.settleMs = moveTimeModel_.settleMs;
+	}
+	return DEVICE_OK;
+}
+
+/**
+* Time left until the move in progress is predicted to be complete and
+* settled, 0 when idle.
+*/
+int ThorlabsKinesisTCubeServo::OnPredictedCompletion(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		double remainingMs = (predictedCompletionUs_ - KinesisStatusCache::NowUs()) / 1000.0;
+		if (remainingMs < 0.0 || !Busy())
+			remainingMs = 0.0;
+		pProp->Set(remainingMs);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnLatencyStat(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		const KinesisHistogram& histogram = latencyStats_.metrics[index / g_NumLatencyStats];
+		switch (index % g_NumLatencyStats)
+		{
+		case 0:
+			pProp->Set(histogram.Percentile(0.5));
+			break;
+		case 1:
+			pProp->Set(histogram.Percentile(0.99));
+			break;
+		default:
+			pProp->Set((double)histogram.Max());
+			break;
+		}
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnPidProfile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(pidProfile_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string name;
+		pProp->Get(name);
+		int ret = ApplyPidProfile(name);
+		if (ret != DEVICE_OK)
+		{
+			pProp->Set(pidProfile_.c_str());
+			return ret;
+		}
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnPidAutoTuneStep(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(autoTuneStepUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(autoTuneStepUm_);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnPidAutoTune(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(0L);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long start;
+		pProp->Get(start);
+		if (start)
+			return AutoTunePid();
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSettleDetection(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	KinesisSettleConfig config = moveTracker_.SettleConfig();
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(config.enabled ? g_Yes : g_No);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		config.enabled = (value == g_Yes);
+		moveTracker_.SetSettleConfig(config);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSettleTolerance(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	KinesisSettleConfig config = moveTracker_.SettleConfig();
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(unitScale_.ToUm(config.toleranceCounts));
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double toleranceUm;
+		pProp->Get(toleranceUm);
+		config.toleranceCounts = unitScale_.ToCounts(toleranceUm);
+		moveTracker_.SetSettleConfig(config);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSettleSamples(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	KinesisSettleConfig config = moveTracker_.SettleConfig();
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)config.samples);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long samples;
+		pProp->Get(samples);
+		config.samples = (int)samples;
+		moveTracker_.SetSettleConfig(config);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSettleTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	KinesisSettleConfig config = moveTracker_.SettleConfig();
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(config.timeoutMs);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(config.timeoutMs);
+		moveTracker_.SetSettleConfig(config);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnPollingInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(moveTracker_.IdlePollingMs());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long intervalMs;
+		pProp->Get(intervalMs);
+		moveTracker_.SetPollingIntervals(intervalMs, moveTracker_.MovingPollingMs());
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnMovingPollingInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(moveTracker_.MovingPollingMs());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long intervalMs;
+		pProp->Get(intervalMs);
+		moveTracker_.SetPollingIntervals(moveTracker_.IdlePollingMs(), intervalMs);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnResetStats(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(0L);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long reset;
+		pProp->Get(reset);
+		if (reset)
+			latencyStats_.Reset();
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnStageProfile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(stageProfile_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(stageProfile_);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnMaxStatusAge(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(maxStatusAgeMs_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(maxStatusAgeMs_);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSequenceOrder(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_SequenceOrders[sequenceOrder_]);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string value;
+		pProp->Get(value);
+		for (int i = 0; i < g_NumSequenceOrders; i++)
+		{
+			if (value == g_SequenceOrders[i])
+				sequenceOrder_ = (KinesisMovePlanner::Order)i;
+		}
+	}
+	return DEVICE_OK;
+}
+
+/**
+* Comma separated positions. Setting it loads and plans them as the stage
+* sequence; reading it returns the sequence in the planned order.
+*/
+int ThorlabsKinesisTCubeServo::OnPositionList(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		std::ostringstream os;
+		for (size_t i = 0; i < sequenceCounts_.size(); i++)
+			os << (i ? "," : "") << unitScale_.ToUm(sequenceCounts_[i]);
+		pProp->Set(os.str().c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		if (sequenceRunning_)
+			return ERR_SEQUENCE_RUNNING;
+
+		std::string value;
+		pProp->Get(value);
+		std::replace(value.begin(), value.end(), ',', ' ');
+		std::istringstream is(value);
+
+		ClearStageSequence();
+		double posUm;
+		while (is >> posUm)
+		{
+			int ret = AddToStageSequence(posUm);
+			if (ret != DEVICE_OK)
+				return ret;
+		}
+		if (!is.eof())
+			return DEVICE_INVALID_PROPERTY_VALUE;
+
+		return SendStageSequence();
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnSequencePlan(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		if (index == 0)
+			pProp->Set(sequencePlan_.totalMs);
+		else if (index == 1)
+			pProp->Set(sequencePlan_.travelUm);
+		else
+			pProp->Set((long)sequencePlan_.reversals);
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnPropertyRefreshRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(propertyRefreshHz_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(propertyRefreshHz_);
+	}
+	return DEVICE_OK;
+}
+
+/*int ThorlabsKinesisTCubeServo::OnStagePositionChanged(long totalSteps)
+{
+ostringstream posStr;
+posStr << "Stage Position with serial number " << serialNumber_ << " changed to in steps " << totalSteps;
+this->LogMessage(posStr.str(), true);
+
+// int newPosition = floor(float(posUm)/1000); // in mm
+SBC_SetMoveAbsolutePosition(serialNo, chNumber_, totalSteps);
+SBC_MoveAbsolute(serialNo, chNumber_);
+return DEVICE_OK;
+}*/
+//////////////////////////////////////////////////trigger mode
+// The trigger move selected here is applied by preloading the relative
+// distance / absolute position on the controller, so the move the trigger
+// executes needs no further parameter transfer over USB. The T-Cube API
+// has no call to configure the trigger input, so there is no trigger mode
+// property.
+
+int ThorlabsKinesisTCubeServo::OnTrigMove(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	std::string val;
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_TrigMoves[mode_m == 1 ? 1 : 0]);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(val);
+		mode_m = val == g_TrigMoves[1] ? 1 : 0;
+		return ApplyTriggerMove();
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnMoveRel(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(moveRelStep_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double moveRelStep;
+		pProp->Get(moveRelStep);
+		moveRelStep_ = moveRelStep;
+
+		KINESIS_LOG(KINESIS_LOG_INFO, "Relative Step Size set to %g", moveRelStep_);
+		return ApplyTriggerMove();
+	}
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::OnTrigAbsPos(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(trigAbsPosUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(trigAbsPosUm_);
+
+		KINESIS_LOG(KINESIS_LOG_INFO, "Trigger absolute position set to %g", trigAbsPosUm_);
+		return ApplyTriggerMove();
+	}
+	return DEVICE_OK;
+}
+
+/**
+* Converts the velocity profiles to um/s and um/s^2 for the move time
+* models. Needs to be called again whenever a profile changes.
+*/
+void ThorlabsKinesisTCubeServo::UpdateMoveTimeModel()
+{
+	std::lock_guard<std::mutex> guard(velocityProfileLock_);
+	moveTimeModel_.maxVelUmPerS = DeviceToReal(defaultVelocity_.maxVelocity, g_UnitVelocity) * 1000;
+	moveTimeModel_.accelUmPerS2 = DeviceToReal(defaultVelocity_.acceleration, g_UnitAcceleration) * 1000;
+	shortMoveTimeModel_.maxVelUmPerS = DeviceToReal(shortMoveVelocity_.maxVelocity, g_UnitVelocity) * 1000;
+	shortMoveTimeModel_.accelUmPerS2 = DeviceToReal(shortMoveVelocity_.acceleration, g_UnitAcceleration) * 1000;
+	shortMoveTimeModel_.settleMs = moveTimeModel_.settleMs;
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "Move time model: vel(um/s):%g accel(um/s^2):%g", moveTimeModel_.maxVelUmPerS, moveTimeModel_.accelUmPerS2);
+}
+
+double ThorlabsKinesisTCubeServo::DeviceToReal(int deviceUnits, int unitType)
+{
+	double realUnits = 0.0;
+	CC_GetRealValueFromDeviceUnit(serialNumber_.c_str(), deviceUnits, &realUnits, unitType);
+	return realUnits;
+}
+
+int ThorlabsKinesisTCubeServo::RealToDevice(double realUnits, int unitType)
+{
+	int deviceUnits = 0;
+	CC_GetDeviceUnitFromRealValue(serialNumber_.c_str(), realUnits, &deviceUnits, unitType);
+	return deviceUnits;
+}
+
+bool ThorlabsKinesisTCubeServo::IsShortMove(long steps) const
+{
+	return shortMoveThresholdCounts_ > 0 && std::labs(steps) <= shortMoveThresholdCounts_;
+}
+
+/**
+* Makes sure the controller holds the profile for a move of the given
+* number of device units; only writes to the device when it changes.
+*/
+void ThorlabsKinesisTCubeServo::SelectVelocityProfile(long steps)
+{
+	MOT_VelocityParameters params;
+	{
+		std::lock_guard<std::mutex> guard(velocityProfileLock_);
+		params = IsShortMove(steps) ? shortMoveVelocity_ : defaultVelocity_;
+	}
+	if (velocityCache_.Apply(params) != 0)
+		KINESIS_LOG(KINESIS_LOG_ERROR, "Failed to set the velocity profile");
+}
+
+/**
+* Predicted duration of a move of the given number of device units with the
+* profile selected for it, including the settle time.
+*/
+double ThorlabsKinesisTCubeServo::GetTravelTimeMs(long steps)
+{
+	std::lock_guard<std::mutex> guard(velocityProfileLock_);
+	const KinesisMoveTimeModel& model = IsShortMove(steps) ? shortMoveTimeModel_ : moveTimeModel_;
+	return model.TravelTimeMs(unitScale_.ToUm((int)steps));
+}
+
+/**
+* Raises the moving flag for a move to targetCounts and records when the
+* move is predicted to be over.
+*/
+void ThorlabsKinesisTCubeServo::StartMoveTracking(int targetCounts)
+{
+	long steps = targetCounts - statusCache_.Read().position;
+	SelectVelocityProfile(steps);
+	double expectedMs = GetTravelTimeMs(steps);
+	predictedCompletionUs_ = KinesisStatusCache::NowUs() + (long long)(expectedMs * 1000);
+	moveTracker_.MoveStarted(expectedMs);
+}
+
+/**
+* Switches the servo loop to one of the named gain sets.
+*/
+int ThorlabsKinesisTCubeServo::ApplyPidProfile(const std::string& name)
+{
+	MOT_DC_PIDParameters params = factoryPid_;
+	if (name == g_PidAutoTuned)
+	{
+		if (!tunedPidValid_)
+			return DEVICE_INVALID_PROPERTY_VALUE;
+		params = tunedPid_;
+	}
+	else if (name != g_PidFactory)
+	{
+		int i = 0;
+		while (i < g_NumPidProfiles && name != g_PidProfiles[i].name)
+			i++;
+		if (i == g_NumPidProfiles)
+			return DEVICE_INVALID_PROPERTY_VALUE;
+		params = ScalePidParams(g_PidProfiles[i].proportionalScale, g_PidProfiles[i].integralScale,
+			g_PidProfiles[i].differentialScale);
+	}
+
+	int ret = SetPidParams(params);
+	if (ret != DEVICE_OK)
+		return ret;
+	pidProfile_ = name;
+	return DEVICE_OK;
+}
+
+int ThorlabsKinesisTCubeServo::SetPidParams(const MOT_DC_PIDParameters& params)
+{
+	MOT_DC_PIDParameters toSend = params;
+	if (CC_SetDCPIDParams(serialNumber_.c_str(), &toSend) != 0)
+		return ERR_PID_FAILED;
+	KINESIS_LOG(KINESIS_LOG_DEBUG, "PID P:%d I:%d D:%d", toSend.proportionalGain, toSend.integralGain, toSend.differentialGain);
+	return DEVICE_OK;
+}
+
+MOT_DC_PIDParameters ThorlabsKinesisTCubeServo::ScalePidParams(double proportionalScale, double integralScale, double differentialScale) const
+{
+	MOT_DC_PIDParameters params = factoryPid_;
+	params.proportionalGain = (int)std::min<double>(g_MaxPidGain, std::lround(factoryPid_.proportionalGain * proportionalScale));
+	params.integralGain = (int)std::min<double>(g_MaxPidGain, std::lround(factoryPid_.integralGain * integralScale));
+	params.differentialGain = (int)std::min<double>(g_MaxPidGain, std::lround(factoryPid_.differentialGain * differentialScale));
+	return params;
+}
+
+/**
+* Runs a step out and back with the given gains and reports the slower of
+* the two command-to-settled times. Returns false if either step did not
+* settle within the settle timeout.
+*/
+bool ThorlabsKinesisTCubeServo::MeasureStepSettleUs(const MOT_DC_PIDParameters& params, int stepCounts, long long& settleUs)
+{
+	if (SetPidParams(params) != DEVICE_OK)
+		return false;
+
+	// step away from the nearer soft limit, a truncated step never reaches
+	// its target and would fail every candidate
+	int origin = GetStatus().position;
+	int stepTarget = origin + stepCounts;
+	if (!travelLimits_.Contains(stepTarget))
+		stepTarget = origin - stepCounts;
+	if (!travelLimits_.Contains(stepTarget))
+		return false;
+
+	long timeoutMs = g_MoveTimeoutMs;
+	settleUs = 0;
+	for (int leg = 0; leg < 2; leg++)
+	{
+		int target = leg == 0 ? stepTarget : origin;
+		long long startUs = KinesisStatusCache::NowUs();
+		StartMoveTracking(target);
+		if (MoveToCounts(target) != 0)
+		{
+			moveTracker_.MoveAborted();
+			return false;
+		}
+		if (!moveTracker_.WaitForMoveComplete(timeoutMs))
+			return false;
+
+		long long legUs = KinesisStatusCache::NowUs() - startUs;
+		// a settle timeout ends the move too, but the step never settled
+		if (std::abs(GetStatus().position - target) > moveTracker_.SettleConfig().toleranceCounts)
+			return false;
+		if (legUs > settleUs)
+			settleUs = legUs;
+	}
+	return true;
+}
+
+/**
+* Tries a grid of gain factors on steps of the auto-tune step size and keeps
+* the one that settles fastest. Blocks until all candidates have been run.
+*/
+int ThorlabsKinesisTCubeServo::AutoTunePid()
+{
+	if (sequenceRunning_)
+		return ERR_SEQUENCE_RUNNING;
+	if (scanRunning_)
+		return ERR_SCAN_RUNNING;
+	if (homingRunning_)
+		return ERR_STAGE_NOT_ZEROED;
+
+	// settle time is what is being minimised, detection has to be on meanwhile
+	KinesisSettleConfig savedConfig = moveTracker_.SettleConfig();
+	KinesisSettleConfig tuneConfig = savedConfig;
+	tuneConfig.enabled = true;
+	moveTracker_.SetSettleConfig(tuneConfig);
+
+	int stepCounts = unitScale_.ToCounts(autoTuneStepUm_);
+	long long bestUs = 0;
+	bool found = false;
+	MOT_DC_PIDParameters best = factoryPid_;
+	const int numPScales = sizeof(g_AutoTuneProportionalScales) / sizeof(g_AutoTuneProportionalScales[0]);
+	const int numDScales = sizeof(g_AutoTuneDifferentialScales) / sizeof(g_AutoTuneDifferentialScales[0]);
+	for (int i = 0; i < numPScales; i++)
+	{
+		for (int j = 0; j < numDScales; j++)
+		{
+			double pScale = g_AutoTuneProportionalScales[i];
+			double dScale = g_AutoTuneDifferentialScales[j];
+			MOT_DC_PIDParameters candidate = ScalePidParams(pScale, 1.0, dScale);
+			long long settleUs;
+			bool settled = MeasureStepSettleUs(candidate, stepCounts, settleUs);
+			KINESIS_LOG(KINESIS_LOG_INFO, "auto-tune P x%g D x%g: %s %lld us", pScale, dScale,
+				settled ? "settled" : "failed", settled ? settleUs : 0LL);
+			if (settled && (!found || settleUs < bestUs))
+			{
+				best = candidate;
+				bestUs = settleUs;
+				found = true;
+			}
+		}
+	}
+
+	moveTracker_.SetSettleConfig(savedConfig);
+	if (!found)
+	{
+		ApplyPidProfile(pidProfile_);
+		return ERR_AUTOTUNE_FAILED;
+	}
+
+	tunedPid_ = best;
+	tunedPidValid_ = true;
+	int ret = ApplyPidProfile(g_PidAutoTuned);
+	if (ret != DEVICE_OK)
+		return ret;
+	OnPropertyChanged(g_PidProfileProp, g_PidAutoTuned);
+	return DEVICE_OK;
+}
+
+/**
+* Sends an absolute move, timing the DLL call.
+*/
+short ThorlabsKinesisTCubeServo::MoveToCounts(int counts)
+{
+	timeline_.RecordCommand(KinesisTimeline::MoveAbsolute, counts);
+	long long startUs = KinesisStatusCache::NowUs();
+	short ret = CC_MoveToPosition(serialNumber_.c_str(), counts);
+	latencyStats_.metrics[KinesisLatencyStats::MoveCommand].Record(KinesisStatusCache::NowUs() - startUs);
+	return ret;
+}
+
+/**
+* Absolute move that, in the "From Below" approach mode, first runs past a
+* lower target by the overshoot and then comes up to it, so the final move
+* always ends in the same direction. Runs on the move worker or the stage
+* sequence thread, as the first leg has to complete before the second is sent.
+*/
+short ThorlabsKinesisTCubeServo::ApproachCounts(int counts)
+{
+	int overshootCounts = unitScale_.ToCounts(approachOvershootUm_);
+	if (!approachFromBelow_ || overshootCounts <= 0 || counts >= statusCache_.Read().position)
+		return MoveToCounts(counts);
+
+	int belowCounts = counts - overshootCounts;
+	if (belowCounts < travelLimits_.minCounts)
+		belowCounts = travelLimits_.minCounts;
+
+	// the caller tracked the move to the final target, each leg gets the
+	// velocity profile and predicted time of its own distance instead
+	approachRunning_ = true;
+	StartMoveTracking(belowCounts);
+	short ret = MoveToCounts(belowCounts);
+	if (ret == 0)
+	{
+		if (!moveTracker_.WaitForMoveComplete(g_MoveTimeoutMs))
+			KINESIS_LOG(KINESIS_LOG_ERROR, "Approach move did not complete in time");
+		StartMoveTracking(counts);
+		ret = MoveToCounts(counts);
+	}
+	approachRunning_ = false;
+	return ret;
+}
+
+/**
+* Sends the relative move distance, unless the controller already holds it.
+*/
+int ThorlabsKinesisTCubeServo::LoadRelativeDistance(int counts)
+{
+	if (relDistanceValid_ && counts == relDistanceCounts_)
+		return DEVICE_OK;
+
+	if (CC_SetMoveRelativeDistance(serialNumber_.c_str(), counts) != 0)
+	{
+		relDistanceValid_ = false;
+		return ERR_MOVE_FAILED;
+	}
+	relDistanceCounts_ = counts;
+	relDistanceValid_ = true;
+	return DEVICE_OK;
+}
+
+/**
+* Loads the move selected by "Trigger Move" into the controller.
+* The controller keeps a single relative distance and a single absolute
+* position, which CC_MoveRelativeDistance / CC_MoveAbsolute (or a trigger
+* input, where the controller has one) then execute.
+*/
+int ThorlabsKinesisTCubeServo::ApplyTriggerMove()
+{
+	int ret = DEVICE_OK;
+	if (mode_m == 0)
+		ret = LoadRelativeDistance(unitScale_.ToCounts(moveRelStep_));
+	else if (mode_m == 1 && CC_SetMoveAbsolutePosition(serialNumber_.c_str(), unitScale_.ToCounts(trigAbsPosUm_)) != 0)
+		ret = ERR_MOVE_FAILED;
+
+	KINESIS_LOG(KINESIS_LOG_INFO, "Trigger move:%s step:%g absolute:%g", g_TrigMoves[mode_m], moveRelStep_, trigAbsPosUm_);
+
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisAxis class
+///////////////////////////////////////////////////////////////////////////////
+
+KinesisAxis::KinesisAxis() :
+	minUm_(0.0),
+	maxUm_(0.0),
+	acquired_(false)
+{
+}
+
+KinesisAxis::~KinesisAxis()
+{
+	Close();
+}
+
+int KinesisAxis::Open(const std::string& serialNo)
+{
+	if (!KinesisDeviceRegistry::Instance().Acquire(serialNo))
+		return DEVICE_NOT_CONNECTED;
+	serialNo_ = serialNo;
+	acquired_ = true;
+
+	int ret = ResolveKinesisUnitScale(serialNo_, g_StageProfileAuto, unitScale_);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	double minMm = 0.0, maxMm = 0.0;
+	CC_GetMotorTravelLimits(serialNo_.c_str(), &minMm, &maxMm);
+	minUm_ = minMm * 1000;
+	maxUm_ = maxMm * 1000;
+
+	// the move time model, as the single-axis stage keeps it
+	int acceleration = 0, maxVelocity = 0;
+	double realUnits = 0.0;
+	CC_GetVelParams(serialNo_.c_str(), &acceleration, &maxVelocity);
+	CC_GetRealValueFromDeviceUnit(serialNo_.c_str(), maxVelocity, &realUnits, g_UnitVelocity);
+	moveTimeModel_.maxVelUmPerS = realUnits * 1000;
+	CC_GetRealValueFromDeviceUnit(serialNo_.c_str(), acceleration, &realUnits, g_UnitAcceleration);
+	moveTimeModel_.accelUmPerS2 = realUnits * 1000;
+
+	statusCache_.SetSerialNo(serialNo_);
+	statusCache_.RequestAndRefresh();
+	moveTracker_.Attach(serialNo_, g_PollingIntervalMs, &statusCache_);
+	return DEVICE_OK;
 }
 
-void ThorlabsKinesisTCubeServo::LogInit()
+void KinesisAxis::Close()
 {
-	tmpMessage = std::stringstream();
-	tmpMessage << deviceName_ << "-" << serialNumber_ << " ";
+	if (!acquired_)
+		return;
+
+	moveTracker_.Detach();
+	KinesisDeviceRegistry::Instance().Release(serialNo_);
+	acquired_ = false;
 }
 
-void ThorlabsKinesisTCubeServo::LogIt()
+int KinesisAxis::MoveToCounts(int counts)
 {
-	LogMessage(tmpMessage.str().c_str());
-	LogInit();
+	int distance = counts - CC_GetPosition(serialNo_.c_str());
+	moveTracker_.MoveStarted(moveTimeModel_.TravelTimeMs(unitScale_.ToUm(distance)));
+	if (CC_MoveToPosition(serialNo_.c_str(), counts) != 0)
+	{
+		moveTracker_.MoveAborted();
+		return ERR_MOVE_FAILED;
+	}
+	return DEVICE_OK;
 }
 
-int ThorlabsKinesisTCubeServo::SetPositionUmFlag(double posUm, int continuousFlag)
+int KinesisAxis::MoveToUm(double posUm)
 {
-	if (posUm < minTravelUm_)
-		posUm = minTravelUm_;
-	else if (posUm > maxTravelUm_)
-		posUm = maxTravelUm_;
-	curPosUm_ = posUm;
-	newPosition = (float)curPosUm_ / 1000 * 34304;
-	CC_MoveToPosition(serialNumber_.c_str(), newPosition);
-	OnStagePositionChanged(curPosUm_);
+	if (posUm < minUm_)
+		posUm = minUm_;
+	else if (posUm > maxUm_)
+		posUm = maxUm_;
 
-	tmpMessage << "SetPositionUm:" << posUm << " continuousFlag:" << continuousFlag;
-	LogIt();
-
-	return DEVICE_OK;
+	return MoveToCounts(unitScale_.ToCounts(posUm));
 }
 
+int KinesisAxis::GetPositionCounts()
+{
+	statusCache_.Refresh();
+	if (statusCache_.AgeMs() > g_PollingIntervalMs)
+		statusCache_.RequestAndRefresh();
 
-/**
-* Send Home command to the stage
-* If stage was already Homed, this command has no effect.
-* If not, then the zero sequence will be initiated.
-*/
+	return statusCache_.Read().position;
+}
 
-int ThorlabsKinesisTCubeServo::Home()
+///////////////////////////////////////////////////////////////////////////////
+// ThorlabsKinesisHub class
+// Owns no hardware itself: it only records which cube drives which axis and
+// exposes the XY and Z stages built on them as peripherals.
+///////////////////////////////////////////////////////////////////////////////
+
+ThorlabsKinesisHub::ThorlabsKinesisHub() :
+	initialized_(false)
 {
-	int ret = DEVICE_OK;
-	CC_Home(serialNumber_.c_str());
+	KinesisDeviceRegistry::Instance().AddClient();
+	InitializeDefaultErrorMessages();
 
-	if (homed_)
-		return ret;
+	CreateProperty(MM::g_Keyword_Name, g_ThorlabsDeviceNameHub, MM::String, true);
+	CreateProperty(MM::g_Keyword_Description, g_ThorlabsDeviceDescHub, MM::String, true);
 
-	if (CC_CanHome(serialNumber_.c_str()))
+	const std::vector<std::string>& serialNos = KinesisDeviceRegistry::Instance().SerialNumbers();
+	for (int axis = 0; axis < NumAxes; axis++)
 	{
-		homed_ = false;
-	}
-	else
-	{
-		homed_ = true;
+		CPropertyActionEx* pAct = new CPropertyActionEx(this, &ThorlabsKinesisHub::OnAxisSerialNumber, axis);
+		CreateProperty(g_AxisSerialProps[axis], g_AxisNone, MM::String, false, pAct, true);
+		AddAllowedValue(g_AxisSerialProps[axis], g_AxisNone);
+		for (size_t i = 0; i < serialNos.size(); i++)
+		{
+			AddAllowedValue(g_AxisSerialProps[axis], serialNos[i].c_str());
+		}
 	}
+}
 
-	return ret;
+ThorlabsKinesisHub::~ThorlabsKinesisHub()
+{
+	Shutdown();
+	for (int axis = 0; axis < NumAxes; axis++)
+		KinesisDeviceRegistry::Instance().CancelPrefetch(axisSerialNos_[axis]);
+	KinesisDeviceRegistry::Instance().RemoveClient();
 }
 
-int ThorlabsKinesisTCubeServo::GetVelParam(double& vel)
+void ThorlabsKinesisHub::GetName(char* pszName) const
 {
-	CC_GetMotorVelocityLimits(serialNumber_.c_str(), &pfMaxVel, &pfMaxAccn);
+	CDeviceUtils::CopyLimitedString(pszName, g_ThorlabsDeviceNameHub);
+}
 
-	vel = (double)pfMaxVel;
+int ThorlabsKinesisHub::Initialize()
+{
+	initialized_ = true;
+	return DEVICE_OK;
+}
 
+int ThorlabsKinesisHub::Shutdown()
+{
+	initialized_ = false;
 	return DEVICE_OK;
 }
 
-int ThorlabsKinesisTCubeServo::SetVelParam(double vel)
+int ThorlabsKinesisHub::DetectInstalledDevices()
 {
-	CC_SetVelParams(serialNumber_.c_str(), pfAccn, pfMaxVel);
+	ClearInstalledDevices();
+
+	if (!axisSerialNos_[AxisX].empty() && !axisSerialNos_[AxisY].empty())
+		AddInstalledDevice(new ThorlabsKinesisXYStage());
+	if (!axisSerialNos_[AxisZ].empty())
+		AddInstalledDevice(new ThorlabsKinesisTCubeServo(g_ThorlabsDeviceNameZStage, 1));
 
 	return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Action handlers
-///////////////////////////////////////////////////////////////////////////////
+const std::string& ThorlabsKinesisHub::GetAxisSerialNumber(int axis) const
+{
+	return axisSerialNos_[axis];
+}
 
-int ThorlabsKinesisTCubeServo::OnSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ThorlabsKinesisHub::OnAxisSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct, long axis)
 {
 	if (eAct == MM::BeforeGet)
 	{
-		pProp->Set(serialNumber_.c_str());
+		pProp->Set(axisSerialNos_[axis].empty() ? g_AxisNone : axisSerialNos_[axis].c_str());
 	}
 	else if (eAct == MM::AfterSet)
 	{
-		if (initialized_)
-		{
-			string serialNumber;
-			pProp->Get(serialNumber);
-			serialNumber_ = serialNumber;
+		std::string serialNo;
+		pProp->Get(serialNo);
+		if (serialNo == g_AxisNone)
+			serialNo = "";
+		if (serialNo != axisSerialNos_[axis])
+			KinesisDeviceRegistry::Instance().CancelPrefetch(axisSerialNos_[axis]);
+		axisSerialNos_[axis] = serialNo;
+		KinesisDeviceRegistry::Instance().Prefetch(axisSerialNos_[axis]);
+	}
+	return DEVICE_OK;
+}
 
-		}
+///////////////////////////////////////////////////////////////////////////////
+// ThorlabsKinesisXYStage class
+// Both axis moves are sent back to back, and the two cubes report their
+// completion messages independently, so an XY move takes as long as the
+// longer of the two axis moves.
+///////////////////////////////////////////////////////////////////////////////
 
-		string serialNumber;
-		pProp->Get(serialNumber);
-		serialNumber_ = serialNumber;
-	}
+ThorlabsKinesisXYStage::ThorlabsKinesisXYStage() :
+	initialized_(false)
+{
+	InitializeDefaultErrorMessages();
+	SetErrorText(ERR_MOVE_FAILED, "The controller rejected the move command.");
+	SetErrorText(ERR_RESPONSE_TIMEOUT, "Device timed-out: no response received withing expected time interval.");
 
-	if (aptInitialized == true)
-		//InitHWDevice(serialNumber_);
+	CreateProperty(MM::g_Keyword_Name, g_ThorlabsDeviceNameXYStage, MM::String, true);
+	CreateProperty(MM::g_Keyword_Description, g_ThorlabsDeviceDescXYStage, MM::String, true);
+}
 
-		tmpMessage << "Serial number set to " << serialNumber_;
-	LogIt();
+ThorlabsKinesisXYStage::~ThorlabsKinesisXYStage()
+{
+	Shutdown();
+}
 
-	return DEVICE_OK;
+void ThorlabsKinesisXYStage::GetName(char* pszName) const
+{
+	CDeviceUtils::CopyLimitedString(pszName, g_ThorlabsDeviceNameXYStage);
 }
 
-int ThorlabsKinesisTCubeServo::OnChannelNumber(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ThorlabsKinesisXYStage::Initialize()
 {
-	if (eAct == MM::BeforeGet)
-	{
-		pProp->Set(chNumber_);
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		if (initialized_)
-		{
-			long chNumber;
-			pProp->Get(chNumber);
-			chNumber_ = chNumber;
+	ThorlabsKinesisHub* hub = static_cast<ThorlabsKinesisHub*>(GetParentHub());
+	if (!hub)
+		return DEVICE_COMM_HUB_MISSING;
 
-		}
+	int ret = xAxis_.Open(hub->GetAxisSerialNumber(ThorlabsKinesisHub::AxisX));
+	if (ret != DEVICE_OK)
+		return ret;
+	ret = yAxis_.Open(hub->GetAxisSerialNumber(ThorlabsKinesisHub::AxisY));
+	if (ret != DEVICE_OK)
+		return ret;
 
-		pProp->Get(chNumber_);
-	}
+	CreateProperty(g_AxisSerialProps[ThorlabsKinesisHub::AxisX], xAxis_.SerialNo().c_str(), MM::String, true);
+	CreateProperty(g_AxisSerialProps[ThorlabsKinesisHub::AxisY], yAxis_.SerialNo().c_str(), MM::String, true);
 
-	tmpMessage << "Channel number set to " << chNumber_;
-	LogIt();
+	initialized_ = true;
+	return DEVICE_OK;
+}
 
+int ThorlabsKinesisXYStage::Shutdown()
+{
+	xAxis_.Close();
+	yAxis_.Close();
+	initialized_ = false;
 	return DEVICE_OK;
 }
 
-int ThorlabsKinesisTCubeServo::OnMinPosUm(MM::PropertyBase* pProp, MM::ActionType eAct)
+bool ThorlabsKinesisXYStage::Busy()
 {
-	if (eAct == MM::BeforeGet)
-	{
-		if (minTravelUm_ > pfMaxPos * 1000)
-			minTravelUm_ = pfMaxPos * 1000;
-		else if (minTravelUm_ < pfMinPos * 1000)
-			minTravelUm_ = pfMinPos * 1000;
-		pProp->Set(minTravelUm_);
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		if (initialized_)
-		{
-			double minTravelUm;
-			pProp->Get(minTravelUm);
-			minTravelUm_ = minTravelUm;
-		}
+	// evaluate both, so each tracker gets its status-bit fallback
+	bool xMoving = xAxis_.MoveTracker().IsMoving();
+	bool yMoving = yAxis_.MoveTracker().IsMoving();
+	return xMoving || yMoving;
+}
 
-		pProp->Get(minTravelUm_);
-		if (minTravelUm_ > pfMaxPos * 1000)
-			minTravelUm_ = pfMaxPos * 1000;
-		else if (minTravelUm_ < pfMinPos * 1000)
-			minTravelUm_ = pfMinPos * 1000;
-	}
+int ThorlabsKinesisXYStage::SetPositionUm(double x, double y)
+{
+	int ret = xAxis_.MoveToUm(x);
+	if (ret != DEVICE_OK)
+		return ret;
+	ret = yAxis_.MoveToUm(y);
+	if (ret != DEVICE_OK)
+		return ret;
 
-	tmpMessage << "minTravelUm_ set to " << minTravelUm_ << " pfMinPos:" << pfMinPos << " pfMaxPos:" << pfMaxPos;
-	LogIt();
+	return OnXYStagePositionChanged(x, y);
+}
 
+int ThorlabsKinesisXYStage::GetPositionUm(double& x, double& y)
+{
+	x = xAxis_.UnitScale().ToUm(xAxis_.GetPositionCounts());
+	y = yAxis_.UnitScale().ToUm(yAxis_.GetPositionCounts());
 	return DEVICE_OK;
 }
 
-int ThorlabsKinesisTCubeServo::OnMaxPosUm(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ThorlabsKinesisXYStage::SetPositionSteps(long x, long y)
 {
-	if (eAct == MM::BeforeGet)
-	{
-		if (maxTravelUm_ > pfMaxPos * 1000)
-			maxTravelUm_ = pfMaxPos * 1000;
-		else if (maxTravelUm_ < pfMinPos * 1000)
-			maxTravelUm_ = pfMinPos * 1000;
-
-		pProp->Set(maxTravelUm_);
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		if (initialized_)
-		{
-			double maxTravelUm;
-			pProp->Get(maxTravelUm);
-			maxTravelUm_ = maxTravelUm;
-		}
-
-		pProp->Get(maxTravelUm_);
-
-		if (maxTravelUm_ > pfMaxPos * 1000)
-			maxTravelUm_ = pfMaxPos * 1000;
-		else if (maxTravelUm_ < pfMinPos * 1000)
-			maxTravelUm_ = pfMinPos * 1000;
-	}
+	int ret = xAxis_.MoveToCounts((int)x);
+	if (ret != DEVICE_OK)
+		return ret;
 
-	tmpMessage << "maxTravelUm_ set to " << maxTravelUm_ << " pfMinPos:" << pfMinPos << " pfMaxPos:" << pfMaxPos;
-	LogIt();
+	return yAxis_.MoveToCounts((int)y);
+}
 
+int ThorlabsKinesisXYStage::GetPositionSteps(long& x, long& y)
+{
+	x = xAxis_.GetPositionCounts();
+	y = yAxis_.GetPositionCounts();
 	return DEVICE_OK;
 }
 
-int ThorlabsKinesisTCubeServo::OnPosition(MM::PropertyBase* pProp, MM::ActionType eAct)
+/**
+* Blocks until both axes have reported their move complete.
+*/
+int ThorlabsKinesisXYStage::WaitForMoveComplete(long timeoutMs)
 {
-	if (eAct == MM::BeforeGet)
-	{
-		double pos = 0.0;
-		int ret = GetPositionUm(pos);
-		if (ret != DEVICE_OK)
-			return ret;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (!xAxis_.MoveTracker().WaitForMoveComplete(timeoutMs))
+		return ERR_RESPONSE_TIMEOUT;
 
-		pProp->Set(pos);
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		double pos = 0.0;
-		pProp->Get(pos);
-		int ret = SetPositionUm(pos);
-		if (ret != DEVICE_OK)
-			return ret;
-	}
+	long elapsedMs = (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	long remainingMs = timeoutMs > elapsedMs ? timeoutMs - elapsedMs : 0;
+	if (!yAxis_.MoveTracker().WaitForMoveComplete(remainingMs))
+		return ERR_RESPONSE_TIMEOUT;
 
 	return DEVICE_OK;
 }
 
-
-int ThorlabsKinesisTCubeServo::OnVelocity(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ThorlabsKinesisXYStage::Home()
 {
-	if (eAct == MM::BeforeGet)
-	{
-		double vel;
-
-		int ret = GetVelParam(vel);
-		if (ret != DEVICE_OK)
-			return ret;
-
-		pProp->Set(vel);
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		double vel;
-		pProp->Get(vel);
-		int ret = SetVelParam(vel);
-		if (ret != DEVICE_OK)
-			return ret;
-	}
+	xAxis_.MoveTracker().MoveStarted();
+	if (CC_Home(xAxis_.SerialNo().c_str()) != 0)
+		xAxis_.MoveTracker().MoveAborted();
+	yAxis_.MoveTracker().MoveStarted();
+	if (CC_Home(yAxis_.SerialNo().c_str()) != 0)
+		yAxis_.MoveTracker().MoveAborted();
 
 	return DEVICE_OK;
 }
 
-int ThorlabsKinesisTCubeServo::OnHome(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ThorlabsKinesisXYStage::Stop()
 {
-	if (eAct == MM::BeforeGet)
-	{
-		pProp->Set((long)homed_);
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		long homed;
-		pProp->Get(homed);
-
-		int ret = Home();
-		if (ret != DEVICE_OK)
-			return ret;
-	}
+	CC_StopProfiled(xAxis_.SerialNo().c_str());
+	CC_StopProfiled(yAxis_.SerialNo().c_str());
 	return DEVICE_OK;
 }
 
-/*int ThorlabsKinesisTCubeServo::OnStagePositionChanged(long totalSteps)
+int ThorlabsKinesisXYStage::SetOrigin()
 {
-ostringstream posStr;
-posStr << "Stage Position with serial number " << serialNumber_ << " changed to in steps " << totalSteps;
-this->LogMessage(posStr.str(), true);
+	return DEVICE_UNSUPPORTED_COMMAND;
+}
 
-// int newPosition = floor(float(posUm)/1000); // in mm
-SBC_SetMoveAbsolutePosition(serialNo, chNumber_, totalSteps);
-SBC_MoveAbsolute(serialNo, chNumber_);
-return DEVICE_OK;
-}*/
-//////////////////////////////////////////////////trigger mode
-/*
-int ThorlabsKinesisTCubeServo::OnTrigMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ThorlabsKinesisXYStage::GetLimitsUm(double& xMin, double& xMax, double& yMin, double& yMax)
 {
-	std::string val;
-	if (eAct == MM::BeforeGet)
-	{
-		switch (mode_)
-		{
-		case 0:
-			val = g_TrigModes[0];
-			break;
-		case 1:
-			val = g_TrigModes[1];
-			break;
-		case 2:
-			val = g_TrigModes[2];
-			break;
-		default:
-			val = g_TrigModes[0];
-			break;
-		}
-		pProp->Set(val.c_str());
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		pProp->Get(val);
-		if (val == g_TrigModes[0])
-		{
-			mode_ = 0;
-			trigmode = 1;
-		}
-		else if (val == g_TrigModes[1])
-		{
-			mode_ = 1;
-			trigmode = 2;
-		}
-		else
-		{
-			mode_ = 2;
-			trigmode = 4;
-		}
-	}
-	SBC_SetTriggerSwitches(serialNo, chNumber_, trigmode + trigmove);
+	xMin = xAxis_.MinUm();
+	xMax = xAxis_.MaxUm();
+	yMin = yAxis_.MinUm();
+	yMax = yAxis_.MaxUm();
 	return DEVICE_OK;
 }
 
-int ThorlabsKinesisTCubeServo::OnTrigMove(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ThorlabsKinesisXYStage::GetStepLimits(long& xMin, long& xMax, long& yMin, long& yMax)
 {
-	std::string val;
-	if (eAct == MM::BeforeGet)
-	{
-		switch (mode_m)
-		{
-		case 0:
-			val = g_TrigMoves[0];
-			break;
-		case 1:
-			val = g_TrigMoves[1];
-			break;
-		case 2:
-			val = g_TrigMoves[2];
-			break;
-		default:
-			val = g_TrigMoves[0];
-			break;
-		}
-		pProp->Set(val.c_str());
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		pProp->Get(val);
-		if (val == g_TrigMoves[0])
-		{
-			mode_m = 0;
-			trigmove = 16;
-		}
-		else if (val == g_TrigMoves[1])
-		{
-			mode_m = 1;
-			trigmove = 32;
-		}
-		else
-		{
-			mode_m = 2;
-			trigmove = 64;
-		}
-	}
-	SBC_SetTriggerSwitches(serialNo, chNumber_, trigmode + trigmove);
+	xMin = xAxis_.UnitScale().ToCounts(xAxis_.MinUm());
+	xMax = xAxis_.UnitScale().ToCounts(xAxis_.MaxUm());
+	yMin = yAxis_.UnitScale().ToCounts(yAxis_.MinUm());
+	yMax = yAxis_.UnitScale().ToCounts(yAxis_.MaxUm());
 	return DEVICE_OK;
 }
 
-int ThorlabsKinesisTCubeServo::OnMoveRel(MM::PropertyBase* pProp, MM::ActionType eAct)
+double ThorlabsKinesisXYStage::GetStepSizeXUm()
 {
-	if (eAct == MM::BeforeGet)
-	{
-		pProp->Set(moveRelStep_);
-	}
-	else if (eAct == MM::AfterSet)
-	{
-		if (initialized_)
-		{
-			long moveRelStep;
-			pProp->Get(moveRelStep);
-			moveRelStep_ = (int)moveRelStep;
-
-		}
-
-		//pProp->Get(moveRelStep_);
-	}
+	return xAxis_.UnitScale().ToUm(1);
+}
 
-	tmpMessage << "Relative Step Size set to " << moveRelStep_;
-	LogIt();
-	SBC_SetMoveRelativeDistance(serialNo, chNumber_, moveRelStep_ * 34304 / 1000);
-	return DEVICE_OK;
-}*/
+double ThorlabsKinesisXYStage::GetStepSizeYUm()
+{
+	return yAxis_.UnitScale().ToUm(1);
+}
 
 // vim: set autoindent tabstop=4 softtabstop=4 shiftwidth=4 expandtab textwidth=78:
 
@@ -31,6 +31,15 @@
 #include "Thorlabs.MotionControl.TCube.DCServo.h"
 #include <string>
 #include <map>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <future>
+#include <cstdio>
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -43,13 +52,700 @@
 #define ERR_BUSY                     10014
 #define ERR_STEPS_OUT_OF_RANGE       10015
 #define ERR_STAGE_NOT_ZEROED         10016
+#define ERR_MOVE_FAILED              10017
+#define ERR_SEQUENCE_EMPTY           10018
+#define ERR_SEQUENCE_RUNNING         10019
+#define ERR_PID_FAILED               10020
+#define ERR_AUTOTUNE_FAILED          10021
+#define ERR_SCAN_RUNNING             10022
+#define ERR_SCAN_INVALID             10023
+#define ERR_HOMING_FAILED            10024
+#define ERR_LIMITS_FAILED            10025
+#define ERR_CONNECTION_LOST          10026
 
 //////////////////////////////////////////////////////////////////////////////
-// Global flag used for the initialisation of the APT subsystem.
-// Want to initialise only once for any number of stages
-// as initialisation takes time.
+// Kinesis message queue identifiers (see "Device Messages" in the Kinesis
+// documentation). Only the generic motor messages are of interest here.
+#define KINESIS_MSG_GENERIC_MOTOR    2
+#define KINESIS_MSG_HOMED            0
+#define KINESIS_MSG_MOVED            1
+#define KINESIS_MSG_STOPPED          2
+#define KINESIS_MSG_LIMIT_UPDATED    3
+
+// Status bits reported by CC_GetStatusBits
+#define KINESIS_STATUS_MOVING_CW     0x00000010
+#define KINESIS_STATUS_MOVING_CCW    0x00000020
+#define KINESIS_STATUS_JOGGING_CW    0x00000040
+#define KINESIS_STATUS_JOGGING_CCW   0x00000080
+#define KINESIS_STATUS_HOMING        0x00000200
+#define KINESIS_STATUS_HOMED         0x00000400
+#define KINESIS_STATUS_IN_MOTION     (KINESIS_STATUS_MOVING_CW | KINESIS_STATUS_MOVING_CCW | \
+                                      KINESIS_STATUS_JOGGING_CW | KINESIS_STATUS_JOGGING_CCW | \
+                                      KINESIS_STATUS_HOMING)
+
+//////////////////////////////////////////////////////////////////////////////
+// Log levels. Messages above KINESIS_LOG_LEVEL compile away, so the debug
+// messages on the position and move paths cost nothing in release builds.
+#define KINESIS_LOG_ERROR            0
+#define KINESIS_LOG_INFO             1
+#define KINESIS_LOG_DEBUG            2
+
+#ifndef KINESIS_LOG_LEVEL
+#ifdef NDEBUG
+#define KINESIS_LOG_LEVEL            KINESIS_LOG_INFO
+#else
+#define KINESIS_LOG_LEVEL            KINESIS_LOG_DEBUG
+#endif
+#endif
+
+// printf-style logging into the device's ring buffer
+#define KINESIS_LOG(level, ...) \
+	do { if ((level) <= KINESIS_LOG_LEVEL) logRing_.Write(__VA_ARGS__); } while (0)
+
+//////////////////////////////////////////////////////////////////////////////
+// Fixed-size ring of formatted log messages; writing never allocates.
+// When full, the oldest message is dropped and counted.
+//
+class KinesisLogRing
+{
+public:
+	enum { NumSlots = 256, SlotSize = 192 };
+
+	KinesisLogRing();
+
+	void Write(const char* format, ...);
+	bool Pop(char* text, size_t size);
+	unsigned TakeDropped();
+
+private:
+	std::mutex lock_;
+	char slots_[NumSlots][SlotSize];
+	unsigned head_;
+	unsigned tail_;
+	unsigned dropped_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Settings Kinesis loads for a cube, cached on disk per serial number so
+// that a warm start can skip CC_LoadSettings. The cache is only used while
+// the cube reports the firmware version it was written with.
+//
+struct KinesisDeviceSettings
+{
+	KinesisDeviceSettings();
+
+	bool ReadFromDevice(const std::string& serialNo);
+	void ApplyToDevice(const std::string& serialNo) const;
+	bool Load(const std::string& serialNo);
+	bool Save(const std::string& serialNo) const;
+
+	static std::string CachePath(const std::string& serialNo);
+	static DWORD FirmwareVersion(const std::string& serialNo);
+
+	DWORD firmwareVersion;
+	double stepsPerRev;
+	double gearBoxRatio;
+	double pitch;
+	double minPositionMm;
+	double maxPositionMm;
+	double maxVelocity;
+	double maxAcceleration;
+	double countsPerMm;
+	MOT_VelocityParameters velParams;
+	MOT_JogParameters jogParams;
+	MOT_HomingParameters homingParams;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Process-wide list of the cubes on the bus.
+// Enumeration takes time, so it is done only once for any number of stages,
+// and each cube is opened once and shared by reference count.
+// Opening (CC_Open + CC_LoadSettings) runs asynchronously, so the cubes of a
+// configuration are opened in parallel once their serial numbers are known
+// and Initialize() only waits for its own cube. The registry is never
+// destroyed: cubes still open are closed by the last Release(), and cubes
+// prefetched but never acquired once the last device using the registry
+// goes away, not from a static destructor under the loader lock.
+//
+class KinesisDeviceRegistry
+{
+public:
+	static KinesisDeviceRegistry& Instance();
+
+	const std::vector<std::string>& SerialNumbers();
+	void Prefetch(const std::string& serialNo);
+	void CancelPrefetch(const std::string& serialNo);
+	void AddClient();
+	void RemoveClient();
+	bool Acquire(const std::string& serialNo);
+	void Release(const std::string& serialNo);
+	bool GetSettings(const std::string& serialNo, KinesisDeviceSettings& settings, bool& fromCache);
+	bool Reconnect(const std::string& serialNo);
+
+private:
+	struct Entry
+	{
+		Entry() : refCount(0), waiters(0), fromCache(false) {}
+		std::shared_future<bool> opened;
+		int refCount;
+		int waiters; // Acquire() calls waiting for the cube to open
+		// written by the opening thread, read once opened is ready
+		KinesisDeviceSettings settings;
+		bool fromCache;
+	};
+
+	KinesisDeviceRegistry();
+	std::shared_future<bool> StartOpen(const std::string& serialNo);
+	static bool OpenDevice(std::string serialNo, KinesisDeviceSettings* settings, bool* fromCache);
+
+	std::mutex lock_;
+	int clients_;
+	bool enumerated_;
+	std::vector<std::string> serialNos_;
+	std::map<std::string, Entry> devices_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Known stages and their resolution, in device counts per mm (per degree
+// for rotation stages, whose positions are then reported in millidegrees).
+//
+struct KinesisStageProfile
+{
+	const char* name;
+	double countsPerUnit;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// um <-> device count conversion, resolved once per stage.
+// The scale is held as Q32 fixed-point counts per nm, so converting a
+// position is a multiply and a shift in 64-bit integer arithmetic.
+//
+class KinesisUnitScale
+{
+public:
+	KinesisUnitScale() { SetCountsPerMm(34304.0); }
+
+	void SetCountsPerMm(double countsPerMm)
+	{
+		countsPerMm_ = countsPerMm;
+		countsPerNmQ32_ = (long long)std::floor(countsPerMm / 1e6 * 4294967296.0 + 0.5);
+		umPerCount_ = 1000.0 / countsPerMm;
+	}
+	double CountsPerMm() const { return countsPerMm_; }
+
+	inline int ToCounts(double um) const
+	{
+		long long nm = std::llround(um * 1000.0);
+		return (int)((nm * countsPerNmQ32_ + (1LL << 31)) >> 32);
+	}
+	inline double ToUm(int counts) const { return counts * umPerCount_; }
+
+private:
+	double countsPerMm_;
+	long long countsPerNmQ32_;
+	double umPerCount_;
+};
+
+int ResolveKinesisUnitScale(const std::string& serialNo, const std::string& profile, KinesisUnitScale& scale);
+
+//////////////////////////////////////////////////////////////////////////////
+// Travel limits in device units: the stage's axis range, and the soft limits
+// inside it. Recomputed only when a limit changes, so that bounding a move
+// is an integer compare.
+//
+struct KinesisTravelLimits
+{
+	KinesisTravelLimits() : stageMinCounts(0), stageMaxCounts(0), minCounts(0), maxCounts(0) {}
+
+	/** Sets the soft limits, bounded by the stage range. */
+	void SetSoftLimits(int lowCounts, int highCounts)
+	{
+		minCounts = lowCounts < stageMinCounts ? stageMinCounts : (lowCounts > stageMaxCounts ? stageMaxCounts : lowCounts);
+		maxCounts = highCounts > stageMaxCounts ? stageMaxCounts : (highCounts < minCounts ? minCounts : highCounts);
+	}
+	inline int Clamp(int counts) const { return counts < minCounts ? minCounts : (counts > maxCounts ? maxCounts : counts); }
+	inline bool Contains(int counts) const { return counts >= minCounts && counts <= maxCounts; }
+
+	int stageMinCounts;
+	int stageMaxCounts;
+	int minCounts;
+	int maxCounts;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Trapezoidal velocity profile model of a move: constant acceleration up to
+// the maximum velocity, cruise, and a symmetric deceleration, followed by a
+// calibrated settle time.
+//
+struct KinesisMoveTimeModel
+{
+	KinesisMoveTimeModel() : accelUmPerS2(0.0), maxVelUmPerS(0.0), settleMs(0.0) {}
+
+	double TravelTimeMs(double distanceUm) const
+	{
+		double d = std::fabs(distanceUm);
+		if (d == 0.0 || accelUmPerS2 <= 0.0 || maxVelUmPerS <= 0.0)
+			return settleMs;
+
+		// distance covered while accelerating to and decelerating from max velocity
+		double rampUm = maxVelUmPerS * maxVelUmPerS / accelUmPerS2;
+		double seconds;
+		if (d < rampUm)
+			seconds = 2.0 * std::sqrt(d / accelUmPerS2);
+		else
+			seconds = 2.0 * maxVelUmPerS / accelUmPerS2 + (d - rampUm) / maxVelUmPerS;
+
+		return seconds * 1000.0 + settleMs;
+	}
+
+	double accelUmPerS2;
+	double maxVelUmPerS;
+	double settleMs;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Chooses the order in which a list of positions is visited. Each segment
+// is predicted with the move time model of the velocity profile the adapter
+// will select for it (short-move profile up to the threshold, default
+// profile otherwise). With a from-below approach, downward segments include
+// the overshoot and the return from it, each leg with its own profile.
+//
+struct KinesisMovePlan
+{
+	KinesisMovePlan() : totalMs(0.0), travelUm(0.0), reversals(0) {}
+
+	std::vector<size_t> order; // indices into the planned positions
+	double totalMs;
+	double travelUm;
+	int reversals;
+};
+
+class KinesisMovePlanner
+{
+public:
+	enum Order { KeepOrder = 0, Shortest, Ascending, Descending, Serpentine };
+
+	KinesisMovePlanner();
+
+	void SetModels(const KinesisMoveTimeModel& defaultModel, const KinesisMoveTimeModel& shortModel, double shortThresholdUm);
+	void SetApproachOvershootUm(double overshootUm) { approachOvershootUm_ = overshootUm; }
+	KinesisMovePlan Plan(const std::vector<double>& positionsUm, double startUm, Order order) const;
+
+private:
+	void Evaluate(const std::vector<double>& positionsUm, double startUm, KinesisMovePlan& plan) const;
+	double LegTimeMs(double distanceUm) const;
+
+	KinesisMoveTimeModel defaultModel_;
+	KinesisMoveTimeModel shortModel_;
+	double shortThresholdUm_;
+	double approachOvershootUm_; // 0 without a from-below approach
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Position sample taken during a constant-velocity scan. The timestamp is on
+// the KinesisStatusCache::NowUs() clock.
+//
+struct KinesisScanSample
+{
+	long long timestampUs;
+	double positionUm;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Position record of the background sampler: timestamp on the
+// KinesisStatusCache::NowUs() clock, position in device counts.
+//
+struct KinesisPositionSample
+{
+	long long timestampUs;
+	int counts;
+	int reserved;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Watches the DLL's local copy of the position for new values, asking the
+// controller for one at most once per interval. A sample is only produced
+// when the copy changes, stamped halfway between the last check that saw the
+// old value and the first that saw the new one. A reply carrying the same
+// position cannot be told apart, so a resting stage produces no samples.
+//
+class KinesisPositionWatch
+{
+public:
+	KinesisPositionWatch() : counts_(0), checkedUs_(0), nextRequestUs_(0) {}
+
+	void Reset(const std::string& serialNo);
+	bool Next(KinesisPositionSample& sample, long intervalMs);
+
+private:
+	std::string serialNo_;
+	int counts_;
+	long long checkedUs_;
+	long long nextRequestUs_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// 32 byte header of the binary record files the adapter writes, followed by
+// recordCount records of recordSize bytes.
+//
+struct KinesisRecordFileHeader
+{
+	char magic[4];
+	unsigned recordSize;
+	unsigned long long recordCount;
+	long long startUs; // first timestamp, on the KinesisStatusCache::NowUs() clock
+	long long reserved;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Append-only memory-mapped file of position samples: a "KPS1" record file
+// header followed by the records. The mapping grows in fixed chunks, and the file is truncated to
+// the records written on Close().
+//
+class KinesisSampleFile
+{
+public:
+	KinesisSampleFile();
+	~KinesisSampleFile() { Close(); }
+
+	bool Open(const std::string& path);
+	void Close();
+	bool IsOpen() const { return base_ != 0; }
+	void Append(const KinesisPositionSample& sample);
+
+private:
+	bool Map(unsigned long long size);
+	void Unmap();
+
+	HANDLE file_;
+	HANDLE mapping_;
+	char* base_;
+	unsigned long long mappedSize_;
+	unsigned long long count_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Background position sampler. The sampling thread is the only producer of
+// a lock-free single-producer / single-consumer ring, which is drained in
+// bulk by the user. When the ring is full new samples are dropped and
+// counted, the optional file receives every sample regardless.
+//
+class KinesisPositionSampler
+{
+public:
+	enum { Capacity = 1 << 16 };
+
+	KinesisPositionSampler();
+	~KinesisPositionSampler() { Stop(); }
+
+	bool Start(const std::string& serialNo, long intervalMs, const std::string& filePath);
+	void Stop();
+	bool IsRunning() const { return running_; }
+
+	size_t Drain(KinesisPositionSample* samples, size_t maxSamples);
+	size_t Pending() const;
+	unsigned long long Dropped() const { return dropped_; }
+
+private:
+	void Run();
+	void Push(const KinesisPositionSample& sample);
+
+	KinesisPositionWatch watch_;
+	long intervalMs_;
+	KinesisPositionSample ring_[Capacity];
+	std::atomic<size_t> head_; // next slot to write, owned by the sampler
+	std::atomic<size_t> tail_; // next slot to read, owned by the consumer
+	std::atomic<unsigned long long> dropped_;
+	std::atomic<bool> running_;
+	std::thread thread_;
+	KinesisSampleFile file_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Timeline record: a command sent to the cube or a message received from it,
+// timestamped on the KinesisStatusCache::NowUs() clock, which all devices of
+// the process share.
+//
+struct KinesisTimelineEvent
+{
+	long long timestampUs;
+	unsigned short type; // Kinesis message type, KinesisTimeline::CommandType for commands
+	unsigned short id;   // message id, or KinesisTimeline::Command
+	int data;            // message data, or the command argument in device counts
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Append-only timeline of the traffic with one cube, for correlating camera
+// frames with stage motion. Commands are recorded by the adapter, messages by
+// the move tracker's message callback. When Capacity events are held new
+// events are dropped and counted. Export() writes the events recorded since
+// the last export, one chunk per acquisition, and starts a new chunk; the
+// binary chunk is a "KTL1" record file.
+//
+class KinesisTimeline
+{
+public:
+	enum { Capacity = 1 << 18 };
+	enum { CommandType = 0xffff };
+	enum Command { MoveAbsolute = 1, MoveRelative, MoveAtVelocity, MoveJog, Home, Stop };
+
+	KinesisTimeline();
+
+	void SetEnabled(bool enabled) { enabled_ = enabled; }
+	bool IsEnabled() const { return enabled_; }
+	void RecordCommand(Command command, int data = 0);
+	void RecordMessage(unsigned short type, unsigned short id, int data);
+
+	bool Export(const std::string& path);
+	size_t Size();
+	unsigned long long Dropped() const { return dropped_; }
+
+private:
+	void Append(const KinesisTimelineEvent& event);
+	static bool WriteCsv(FILE* file, const std::vector<KinesisTimelineEvent>& events);
+	static bool WriteBinary(FILE* file, const std::vector<KinesisTimelineEvent>& events);
+
+	std::atomic<bool> enabled_;
+	std::mutex lock_;
+	std::vector<KinesisTimelineEvent> events_;
+	std::atomic<unsigned long long> dropped_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Named servo loop tunings, as factors applied to the gains the controller
+// reported at start-up.
+//
+struct KinesisPidProfile
+{
+	const char* name;
+	double proportionalScale;
+	double integralScale;
+	double differentialScale;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Lock-free log-linear histogram.
+// Values up to 7 have a bucket each; above that every power of two is split
+// into 8 linear sub-buckets, so the relative resolution is 1/8 from 1 us to
+// well over an hour.
 //
-bool aptInitialized = false;
+class KinesisHistogram
+{
+public:
+	enum { SubBuckets = 8, NumBuckets = 30 * SubBuckets };
+
+	KinesisHistogram() { Reset(); }
+
+	void Record(unsigned long long value);
+	void Reset();
+	unsigned long long Count() const;
+	double Percentile(double fraction) const;
+	unsigned long long Max() const { return max_.load(std::memory_order_relaxed); }
+
+private:
+	static int BucketIndex(unsigned long long value);
+	static double BucketMidpoint(int index);
+
+	std::atomic<unsigned> buckets_[NumBuckets];
+	std::atomic<unsigned long long> max_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Per-device latency statistics, in us, except for the Busy() poll count
+// which is the number of Busy() calls made during one move.
+//
+struct KinesisLatencyStats
+{
+	enum Metric { MoveCommand = 0, GetPosition, RequestStatus, MoveToMessage, BusyPolls, Settle, NumMetrics };
+
+	void Reset()
+	{
+		for (int i = 0; i < NumMetrics; i++)
+			metrics[i].Reset();
+	}
+
+	KinesisHistogram metrics[NumMetrics];
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Snapshot of the device state as last reported through the Kinesis polling
+// loop. Positions and velocities are in device units.
+//
+struct KinesisStatusSnapshot
+{
+	int position;
+	DWORD statusBits;
+	MOT_VelocityParameters velParams;
+	long long timestampUs;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Device-backed property values, read once per property refresh cycle so
+// that a property browser refresh costs one status read rather than one per
+// property.
+//
+struct KinesisPropertySnapshot
+{
+	KinesisPropertySnapshot() : positionUm(0.0), velocityMmPerS(0.0), statusBits(0), timestampUs(0) {}
+
+	double positionUm;
+	double velocityMmPerS;
+	DWORD statusBits;
+	long long timestampUs;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Controller-side velocity profile, cached so that it is only written when
+// the requested profile differs from the one the controller already holds.
+//
+class KinesisVelocityProfileCache
+{
+public:
+	KinesisVelocityProfileCache() : valid_(false)
+	{
+		active_.minVelocity = active_.acceleration = active_.maxVelocity = 0;
+	}
+
+	void SetSerialNo(const std::string& serialNo) { serialNo_ = serialNo; }
+	short Load();
+	short Apply(const MOT_VelocityParameters& params);
+	MOT_VelocityParameters Active();
+
+private:
+	std::string serialNo_;
+	std::mutex lock_;
+	MOT_VelocityParameters active_;
+	bool valid_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Seqlock-protected status snapshot.
+// Writers (the message callback or a getter forcing a refresh) are
+// serialised, readers never block and simply retry if they raced a writer.
+// The timestamp is when the values were last known to come from the
+// controller: a message, a changed value, or at the latest one polling
+// interval ago while the Kinesis polling loop runs.
+//
+class KinesisStatusCache
+{
+public:
+	KinesisStatusCache();
+
+	void SetSerialNo(const std::string& serialNo) { serialNo_ = serialNo; }
+	void SetLatencyStats(KinesisLatencyStats* stats) { stats_ = stats; }
+	void SetPollingInterval(long pollingMs) { pollingMs_ = pollingMs; }
+	void Refresh(bool updateReceived = false);
+	void RequestAndRefresh();
+	KinesisStatusSnapshot Read() const;
+	double AgeMs() const;
+
+	static long long NowUs();
+
+private:
+	void Publish(KinesisStatusSnapshot& snapshot, bool updateReceived);
+
+	std::string serialNo_;
+	KinesisLatencyStats* stats_;
+	std::atomic<long> pollingMs_;
+	std::mutex writeLock_;
+	long long lastUpdateUs_;
+	std::atomic<unsigned> sequence_;
+	std::atomic<int> position_;
+	std::atomic<DWORD> statusBits_;
+	std::atomic<int> minVelocity_;
+	std::atomic<int> acceleration_;
+	std::atomic<int> maxVelocity_;
+	std::atomic<long long> timestampUs_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Settle detection parameters: after the move-complete message the position
+// is sampled once per Kinesis poll until it stays within toleranceCounts for
+// samples consecutive polls, or timeoutMs passes.
+//
+struct KinesisSettleConfig
+{
+	KinesisSettleConfig() : enabled(false), toleranceCounts(2), samples(5), timeoutMs(500) {}
+
+	bool enabled;
+	int toleranceCounts;
+	int samples;
+	long timeoutMs;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Tracks move completion from the Kinesis message queue, so Busy() does not
+// have to query the controller.
+//
+// The Kinesis message callback takes no arguments, so every attached tracker
+// is kept in a process-wide list and a single callback drains the queue of
+// each of them. The moving flag is raised by the adapter when it issues a
+// move and cleared on the "moved", "homed" or "stopped" message.
+//
+class KinesisMoveTracker
+{
+public:
+	KinesisMoveTracker();
+	~KinesisMoveTracker();
+
+	void Attach(const std::string& serialNo, long pollingMs, KinesisStatusCache* statusCache);
+	void Detach();
+	void Reconnected();
+	void SetLatencyStats(KinesisLatencyStats* stats) { stats_ = stats; }
+	void SetTimeline(KinesisTimeline* timeline) { timeline_ = timeline; }
+	void SetSettleConfig(const KinesisSettleConfig& config);
+	KinesisSettleConfig SettleConfig();
+	void SetPollingIntervals(long idleMs, long movingMs);
+	long IdlePollingMs() const { return idlePollingMs_; }
+	long MovingPollingMs() const { return movingPollingMs_; }
+
+	void MoveStarted(double expectedMs = 0.0);
+	void MoveAborted();
+	bool IsMoving();
+	bool WaitForMoveComplete(long timeoutMs);
+
+private:
+	static void OnKinesisMessage();
+	void ProcessMessages();
+	void MoveFinished();
+	bool StatusBitsIdle();
+	void StartSettling();
+	void RunSettleWorker();
+	bool WaitForSettled(const KinesisSettleConfig& config);
+	void ApplyPolling(bool fast, bool force = false);
+
+	static std::mutex registryLock_;
+	static std::vector<KinesisMoveTracker*> registry_;
+
+	std::string serialNo_;
+	KinesisStatusCache* statusCache_;
+	std::atomic<bool> moving_;
+	std::mutex lock_;
+	std::condition_variable moveDone_;
+	std::chrono::steady_clock::time_point lastCheck_;
+	long graceMs_;
+	KinesisLatencyStats* stats_;
+	KinesisTimeline* timeline_;
+	long long moveStartUs_;
+	std::atomic<unsigned> busyPolls_;
+
+	// settle detection
+	KinesisSettleConfig settleConfig_;
+	std::atomic<bool> settling_;
+	unsigned settleGeneration_;
+	bool settleWorkerRunning_;
+	std::condition_variable settleCond_;
+	std::thread settleWorker_;
+
+	// adaptive polling: pollingMs_ is the rate running on the cube, the
+	// moving rate from the start of a move until shortly after it ended
+	std::atomic<long> pollingMs_;
+	std::atomic<long> idlePollingMs_;
+	std::atomic<long> movingPollingMs_;
+	std::atomic<bool> pollingFast_;
+	std::mutex pollingLock_;
+	std::chrono::steady_clock::time_point idleSince_;
+};
 
 class ThorlabsKinesisTCubeServo : public CStageBase<ThorlabsKinesisTCubeServo>
 {
@@ -70,16 +766,40 @@ public:
 	// ---------
 	int SetPositionUm(double posUm);
 	int SetPositionUmContinuous(double posUm);
+	int SetRelativePositionUm(double dUm);
 	int GetPositionUm(double& pos);
 	int SetPositionSteps(long steps);
 	int GetPositionSteps(long& steps);
 	int SetOrigin();
 	int GetLimits(double& min, double& max);
 	int SetLimits(double min, double max);
+	int WaitForMoveComplete(long timeoutMs);
 
-	int IsStageSequenceable(bool& isSequenceable) const { isSequenceable = false; return DEVICE_OK; }
+	int IsStageSequenceable(bool& isSequenceable) const { isSequenceable = sequenceable_; return DEVICE_OK; }
 	bool IsContinuousFocusDrive() const { return false; }
 
+	// Sequence API
+	// ------------
+	int GetStageSequenceMaxLength(long& nrEvents) const;
+	int StartStageSequence();
+	int StopStageSequence();
+	int ClearStageSequence();
+	int AddToStageSequence(double position);
+	int SendStageSequence();
+
+	// Continuous scan API
+	// -------------------
+	int StartScan();
+	int StopScan();
+	bool IsScanning() const { return scanRunning_; }
+	void GetScanSamples(std::vector<KinesisScanSample>& samples);
+	bool GetScanPositionUm(long long timestampUs, double& posUm);
+	bool ExportScanSamples(const std::string& path);
+
+	// Position sampler API
+	// --------------------
+	size_t DrainPositionSamples(KinesisPositionSample* samples, size_t maxSamples);
+
 	// action interface
 	// ----------------
 	int OnSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct);
@@ -88,28 +808,120 @@ public:
 	int OnMaxPosUm(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnPosition(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnVelocity(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnVelocityProfile(MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+	int OnShortMoveThreshold(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnScan(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnScanParam(MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+	int OnScanSampleCount(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnScanExport(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnJogMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnBacklash(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnApproachMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnApproachOvershoot(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnJogStep(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnJogVelocity(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSampler(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSamplerInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSamplerFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSamplerPending(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSamplerDropped(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTimeline(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTimelineExport(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTimelineEvents(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTimelineDropped(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnHome(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHomeOnInitialize(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHomingState(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHomingProgress(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStageProfile(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnAsyncMoves(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSettleTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPredictedCompletion(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLatencyStat(MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+	int OnSettleDetection(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPidProfile(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPidAutoTune(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPidAutoTuneStep(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSettleTolerance(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSettleSamples(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSettleTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPollingInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnMovingPollingInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnResetStats(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnMaxStatusAge(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSequenceOrder(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPositionList(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSequencePlan(MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+	int OnPropertyRefreshRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSoftLimitPolicy(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnConnection(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnWatchdogTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnReconnects(MM::PropertyBase* pProp, MM::ActionType eAct);
 
-	//int OnTrigMode(MM::PropertyBase* pProp, MM::ActionType eAct);
-	//int OnTrigMove(MM::PropertyBase* pProp, MM::ActionType eAct);
-	//int OnMoveRel(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTrigMove(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnMoveRel(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTrigAbsPos(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
 
 	//   bool GetValue(std::string& sMessage, double& pos);
 	//   int SetMaxTravel();
-	//   double GetTravelTimeMs(long steps);
+	double GetTravelTimeMs(long steps);
 
 	void init(std::string deviceName, long chNumber);
 	int SetPositionUmFlag(double posUm, int continuousFlag);
-	void LogInit();
-	void LogIt();
+	void StartLogFlusher();
+	void StopLogFlusher();
+	void RunLogFlusher();
+	void FlushLog();
 	int Home();
+	int ForceHome();
+	bool IsHomed();
+	bool IsHoming() const { return homingRunning_; }
+	int RunHoming();
+	void StartBackgroundHoming();
+	void StopBackgroundHoming();
+	void UpdateHomingProgress(const KinesisStatusSnapshot& status);
 	int GetVelParam(double &vel);
 	int SetVelParam(double vel);
+	KinesisStatusSnapshot GetStatus();
+	const KinesisPropertySnapshot& GetPropertySnapshot(bool force = false);
+	void RunStageSequence();
+	int ApplyTriggerMove();
+	int LoadRelativeDistance(int counts);
+	void UpdateMoveTimeModel();
+	double DeviceToReal(int deviceUnits, int unitType);
+	int RealToDevice(double realUnits, int unitType);
+	bool IsShortMove(long steps) const;
+	void SelectVelocityProfile(long steps);
+	double GetScanVelocityUmPerS() const;
+	void RunScan();
+	int LoadJogParams();
+	short JogToCounts(int targetCounts);
+	void StartMoveTracking(int targetCounts);
+	short MoveToCounts(int counts);
+	short ApproachCounts(int counts);
+	bool UsesMoveWorker() const { return asyncMoves_ || jogMode_ || approachFromBelow_; }
+	int ApplyPidProfile(const std::string& name);
+	int SetPidParams(const MOT_DC_PIDParameters& params);
+	MOT_DC_PIDParameters ScalePidParams(double proportionalScale, double integralScale, double differentialScale) const;
+	bool MeasureStepSettleUs(const MOT_DC_PIDParameters& params, int stepCounts, long long& settleUs);
+	int AutoTunePid();
+	int ResolveUnitScale();
+	int UpdateTravelLimits();
+	void QueueMove(int targetCounts);
+	void StopMoveWorker();
+	void StartWatchdog();
+	void StopWatchdog();
+	void RunWatchdog();
+	bool Reconnect();
+	int SendTravelLimits();
+	int ApplySoftLimitPolicy(int& counts) const;
+	void RunMoveWorker();
 
 	//Private variables
-	std::stringstream tmpMessage;
+	KinesisLogRing logRing_;
 	int hwType_;
 	std::string deviceName_;
 	long chNumber_;
@@ -117,13 +929,19 @@ private:
 	double stepSizeUm_;
 	bool initialized_;
 	bool busy_;
-	bool homed_;
+	std::atomic<bool> homed_;
 	double answerTimeoutMs_;
 	double minTravelUm_;
 	double maxTravelUm_;
-	float curPosUm_; // cached current position
-	float pfPosition;
-	float newPosition;
+	KinesisTravelLimits travelLimits_; // minTravelUm_ / maxTravelUm_ in device units
+	int softLimitPolicy_; // MOT_LimitsSoftwareApproachPolicy
+	double curPosUm_; // cached current position
+	std::string stageProfile_;
+	bool deviceAcquired_;
+	KinesisDeviceSettings settings_;
+	bool settingsValid_;
+	bool settingsFromCache_;
+	KinesisUnitScale unitScale_;
 	float newVel;
 	double pfMaxVel;
 	float pfMinVel;
@@ -135,13 +953,100 @@ private:
 	float pfPitch;
 
 	double ccdT_;
-	int mode_;
 	int mode_m;
-	int trigmode;
-	int trigmove;
-	long trigModeNumber_;
 	long trigMoveNumber_;
-	float moveRelStep_;
+	double moveRelStep_;
+	double trigAbsPosUm_;
+
+	// relative distance currently loaded in the controller
+	int relDistanceCounts_;
+	bool relDistanceValid_;
+
+	// move time prediction
+	KinesisMoveTimeModel moveTimeModel_;
+	std::atomic<long long> predictedCompletionUs_;
+
+	KinesisLatencyStats latencyStats_;
+
+	// velocity profiles: the default one, and one for moves up to
+	// shortMoveThresholdCounts_ (0 disables it)
+	KinesisVelocityProfileCache velocityCache_;
+	std::mutex velocityProfileLock_;
+	MOT_VelocityParameters defaultVelocity_;
+	MOT_VelocityParameters shortMoveVelocity_;
+	int shortMoveThresholdCounts_;
+	KinesisMoveTimeModel shortMoveTimeModel_;
+
+	// continuous scan
+	double scanStartUm_;
+	double scanEndUm_;
+	double scanVelocityUmPerS_;
+	double scanFrameRateHz_;
+	double scanStepUm_;
+	std::atomic<bool> scanRunning_;
+	std::thread scanThread_;
+	std::mutex scanLock_;
+	std::vector<KinesisScanSample> scanSamples_;
+	std::string scanExport_;
+
+	// jog mode: targets go through the move worker and are sent as jogs
+	std::atomic<bool> jogMode_;
+	double jogStepUm_;
+	double jogVelocityMmPerS_;
+	int jogStepCounts_; // step size the controller holds
+
+	// approach: controller backlash correction, and optionally a software
+	// approach that ends every move travelling upwards
+	int backlashCounts_;
+	std::atomic<bool> approachFromBelow_;
+	double approachOvershootUm_;
+	std::atomic<bool> approachRunning_; // between the two legs of an approach
+
+	// position sampler
+	KinesisPositionSampler positionSampler_;
+	long samplerIntervalMs_;
+	std::string samplerFile_;
+
+	// motion timeline
+	KinesisTimeline timeline_;
+	std::string timelineExport_;
+
+	// servo loop tuning
+	MOT_DC_PIDParameters factoryPid_;
+	MOT_DC_PIDParameters tunedPid_;
+	bool tunedPidValid_;
+	std::string pidProfile_;
+	double autoTuneStepUm_;
+
+	// property refresh: BeforeGet handlers read this snapshot, renewed at
+	// most propertyRefreshHz_ times per second (0 renews on every read)
+	KinesisPropertySnapshot propertySnapshot_;
+	double propertyRefreshHz_;
+
+	// homing: the controller keeps its homed bit for the power cycle, so
+	// the adapter only homes when that bit is clear
+	std::string homeOnInitialize_;
+	bool needsHoming_;
+	std::atomic<bool> homingRunning_;
+	std::atomic<long> homingProgress_; // percent
+	int homingStartCounts_;
+	std::thread homingThread_;
+
+	// log flusher
+	std::thread logFlusher_;
+	std::mutex logFlusherLock_;
+	std::condition_variable logFlusherCond_;
+	bool logFlusherRunning_;
+
+	// connection watchdog: the Kinesis last-message timer overruns when the
+	// cube stops answering the polling, e.g. after a USB hub reset
+	std::thread watchdog_;
+	std::mutex watchdogLock_;
+	std::condition_variable watchdogCond_;
+	bool watchdogRunning_;
+	long watchdogTimeoutMs_; // 0 disables the watchdog
+	std::atomic<bool> connectionLost_;
+	std::atomic<long> reconnects_;
 
 	double home;
 
@@ -157,6 +1062,30 @@ private:
 	std::string serialNo_;
 	long accel_;
 	long maxVel_;
+	KinesisMoveTracker moveTracker_;
+	KinesisStatusCache statusCache_;
+	double maxStatusAgeMs_;
+
+	// stage sequence: positions are added in um and converted to device
+	// units once, in SendStageSequence(). The sequence runs freely from one
+	// position to the next, it does not wait for camera triggers, so it is
+	// only offered to the core when enabled.
+	bool sequenceable_;
+	std::vector<double> sequenceUm_;
+	std::vector<int> sequenceCounts_;
+	KinesisMovePlanner::Order sequenceOrder_;
+	KinesisMovePlan sequencePlan_;
+	std::thread sequenceThread_;
+	std::atomic<bool> sequenceRunning_;
+
+	// asynchronous moves: a single pending target, replaced by newer ones
+	bool asyncMoves_;
+	std::mutex moveQueueLock_;
+	std::condition_variable moveQueueCond_;
+	std::atomic<bool> movePending_;
+	int pendingTarget_;
+	bool moveWorkerRunning_;
+	std::thread moveWorker_;
 
 	// helpers
 	//int OnStagePositionChanged(long totalSteps);
@@ -167,4 +1096,107 @@ private:
 
 };
 
+//////////////////////////////////////////////////////////////////////////////
+// One cube used as an axis of a multi-axis stage
+//
+class KinesisAxis
+{
+public:
+	KinesisAxis();
+	~KinesisAxis();
+
+	int Open(const std::string& serialNo);
+	void Close();
+
+	int MoveToCounts(int counts);
+	int MoveToUm(double posUm);
+	int GetPositionCounts();
 
+	const std::string& SerialNo() const { return serialNo_; }
+	const KinesisUnitScale& UnitScale() const { return unitScale_; }
+	KinesisMoveTracker& MoveTracker() { return moveTracker_; }
+	double MinUm() const { return minUm_; }
+	double MaxUm() const { return maxUm_; }
+
+private:
+	std::string serialNo_;
+	KinesisStatusCache statusCache_;
+	KinesisMoveTracker moveTracker_;
+	KinesisUnitScale unitScale_;
+	KinesisMoveTimeModel moveTimeModel_;
+	double minUm_;
+	double maxUm_;
+	bool acquired_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Hub combining several cubes into an XY stage and a Z stage
+//
+class ThorlabsKinesisHub : public HubBase<ThorlabsKinesisHub>
+{
+public:
+	enum Axis { AxisX = 0, AxisY, AxisZ, NumAxes };
+
+	ThorlabsKinesisHub();
+	~ThorlabsKinesisHub();
+
+	// Device API
+	// ----------
+	int Initialize();
+	int Shutdown();
+	void GetName(char* pszName) const;
+	bool Busy() { return false; }
+
+	// Hub API
+	// -------
+	int DetectInstalledDevices();
+
+	const std::string& GetAxisSerialNumber(int axis) const;
+
+	// action interface
+	// ----------------
+	int OnAxisSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct, long axis);
+
+private:
+	bool initialized_;
+	std::string axisSerialNos_[NumAxes];
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// XY stage on two cubes of the hub
+//
+class ThorlabsKinesisXYStage : public CXYStageBase<ThorlabsKinesisXYStage>
+{
+public:
+	ThorlabsKinesisXYStage();
+	~ThorlabsKinesisXYStage();
+
+	// Device API
+	// ----------
+	int Initialize();
+	int Shutdown();
+	void GetName(char* pszName) const;
+	bool Busy();
+
+	// XYStage API
+	// -----------
+	int SetPositionUm(double x, double y);
+	int GetPositionUm(double& x, double& y);
+	int SetPositionSteps(long x, long y);
+	int GetPositionSteps(long& x, long& y);
+	int Home();
+	int Stop();
+	int SetOrigin();
+	int GetLimitsUm(double& xMin, double& xMax, double& yMin, double& yMax);
+	int GetStepLimits(long& xMin, long& xMax, long& yMin, long& yMax);
+	double GetStepSizeXUm();
+	double GetStepSizeYUm();
+	int IsXYStageSequenceable(bool& isSequenceable) const { isSequenceable = false; return DEVICE_OK; }
+
+	int WaitForMoveComplete(long timeoutMs);
+
+private:
+	bool initialized_;
+	KinesisAxis xAxis_;
+	KinesisAxis yAxis_;
+};